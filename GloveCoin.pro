@@ -237,7 +237,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/hash.h \
     src/uint256.h \
+    src/arith_uint256.h \
     src/kernel.h \
+    src/checkqueue.h \
     src/scrypt.h \
     src/pbkdf2.h \
     src/serialize.h \
@@ -246,6 +248,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/miner.h \
     src/net.h \
     src/key.h \
+    src/blockfile.h \
+    src/secp256k1.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
@@ -322,6 +326,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/hash.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/blockfile.cpp \
+    src/secp256k1.cpp \
     src/script.cpp \
     src/core.cpp \
     src/main.cpp \
@@ -1,9 +1,22 @@
 #ifndef BITCOIN_ARITH_UINT256_H
 #define BITCOIN_ARITH_UINT256_H
 
+#include <assert.h>
+#include <stdexcept>
+
 // Temporary for migration to opaque uint160/256
 #include "uint256.h"
 
+class uint_error : public std::runtime_error {
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** 256-bit unsigned integer with the arithmetic needed by the difficulty,
+ * chain trust and stake kernel code. Unlike CBigNum it lives on the stack
+ * and never allocates; results wrap modulo 2^256, so callers that can
+ * exceed 256 bits must check for it.
+ */
 class arith_uint256 : public uint256 {
 public:
     arith_uint256() {}
@@ -11,9 +24,125 @@ public:
     arith_uint256(uint64_t b) : uint256(b) {}
     explicit arith_uint256(const std::string& str) : uint256(str) {}
     explicit arith_uint256(const std::vector<unsigned char>& vch) : uint256(vch) {}
+
+    arith_uint256& operator*=(const arith_uint256& b)
+    {
+        arith_uint256 a = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++) {
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++) {
+                uint64_t n = carry + pn[i + j] + (uint64_t)a.pn[j] * b.pn[i];
+                pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        return *this;
+    }
+
+    arith_uint256& operator/=(const arith_uint256& b)
+    {
+        arith_uint256 div = b;     // make a copy, so we can shift.
+        arith_uint256 num = *this; // make a copy, so we can subtract.
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;             // the quotient.
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw uint_error("Division by zero");
+        if (div_bits > num_bits) // the result is certainly 0.
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align.
+        while (shift >= 0) {
+            if (num >= div) {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31)); // set a bit of the result.
+            }
+            div >>= 1; // shift back.
+            shift--;
+        }
+        // num now contains the remainder of the division.
+        return *this;
+    }
+
+    /** Position of the highest set bit plus one, or zero */
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--) {
+            if (pn[pos]) {
+                for (int nbits = 31; nbits > 0; nbits--) {
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                }
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * The "compact" format is a representation of a whole number N using an
+     * unsigned 32bit number similar to a floating point format. The most
+     * significant 8 bits are the unsigned exponent of base 256. This exponent
+     * can be thought of as "number of bytes of N". The lower 23 bits are the
+     * mantissa. Bit number 24 (0x800000) represents the sign of N.
+     * N = (-1^sign) * mantissa * 256^(exponent-3)
+     *
+     * This is the same encoding CBigNum::SetCompact/GetCompact produce through
+     * OpenSSL's MPI format. Only the magnitude is kept here: pfNegative and
+     * pfOverflow report a negative value or one that does not fit in 256
+     * bits, in which case the low 256 bits of the magnitude are stored.
+     */
+    arith_uint256& SetCompact(unsigned int nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3) {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        } else {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    unsigned int GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3) {
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        } else {
+            arith_uint256 bn = *this >> 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000) {
+            nCompact >>= 8;
+            nSize++;
+        }
+        assert((nCompact & ~0x007fffff) == 0);
+        assert(nSize < 256);
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
 };
 
+inline const arith_uint256 operator*(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) /= b; }
+
 #define ArithToUint256(x) (x)
 #define UintToArith256(x) (x)
 
-#endif // BITCOIN_UINT256_H
+#endif // BITCOIN_ARITH_UINT256_H
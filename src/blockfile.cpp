@@ -0,0 +1,198 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+using namespace std;
+
+CBlockFileReader blockFileReader(MAX_OPEN_BLOCK_FILES);
+CBlockFileWriter blockFileWriter;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+CBlockFileHandle::~CBlockFileHandle()
+{
+    close(fd);
+}
+
+static int PositionalRead(int fd, char* pch, unsigned int nSize, unsigned int nPos)
+{
+#ifdef WIN32
+    // ReadFile with an explicit offset does not depend on the shared file
+    // pointer either
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = nPos;
+    DWORD nRead = 0;
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), pch, nSize, &nRead, &overlapped))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    return nRead;
+#else
+    return pread(fd, pch, nSize, nPos);
+#endif
+}
+
+boost::shared_ptr<CBlockFileHandle> CBlockFileReader::Get(unsigned int nFile)
+{
+    LOCK(cs);
+
+    map<unsigned int, CEntry>::iterator it = mapOpen.find(nFile);
+    if (it != mapOpen.end())
+    {
+        it->second.nLastUsed = ++nUseCounter;
+        return it->second.handle;
+    }
+
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return boost::shared_ptr<CBlockFileHandle>();
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return boost::shared_ptr<CBlockFileHandle>();
+
+    // Readers still holding the evicted handle keep it open until they finish
+    if (mapOpen.size() >= nMaxOpen)
+    {
+        map<unsigned int, CEntry>::iterator itOldest = mapOpen.begin();
+        for (it = mapOpen.begin(); it != mapOpen.end(); ++it)
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        mapOpen.erase(itOldest);
+    }
+
+    CEntry& entry = mapOpen[nFile];
+    entry.handle.reset(new CBlockFileHandle(fd));
+    entry.nLastUsed = ++nUseCounter;
+    return entry.handle;
+}
+
+int CBlockFileReader::Read(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize)
+{
+    boost::shared_ptr<CBlockFileHandle> handle = Get(nFile);
+    if (!handle)
+        return -1;
+
+    unsigned int nDone = 0;
+    while (nDone < nSize)
+    {
+        int nRead = PositionalRead(handle->fd, pch + nDone, nSize - nDone, nPos + nDone);
+        if (nRead < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nRead == 0)
+            break; // end of file
+        nDone += nRead;
+    }
+    return nDone;
+}
+
+bool CBlockFileWriter::Open()
+{
+    file = fopen(BlockFilePath(nFile).string().c_str(), "ab");
+    if (!file)
+        return false;
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        CloseFile();
+        return false;
+    }
+    long nEnd = ftell(file);
+    if (nEnd < 0)
+    {
+        CloseFile();
+        return false;
+    }
+    nPos = nAllocated = nEnd;
+    return true;
+}
+
+void CBlockFileWriter::CloseFile()
+{
+    if (file)
+    {
+        if (nUnsynced)
+            FileCommit(file);
+        fclose(file);
+    }
+    file = NULL;
+    nUnsynced = 0;
+}
+
+bool CBlockFileWriter::Write(const char* pch, unsigned int nSize, unsigned int& nFileRet, unsigned int& nPosRet)
+{
+    LOCK(cs);
+
+    nFileRet = 0;
+    while (true)
+    {
+        if (!file && !Open())
+            return false;
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+        if (nPos < (unsigned int)(0x7F000000 - MAX_SIZE))
+            break;
+        CloseFile();
+        nFile++;
+    }
+
+    if (nPos + nSize > nAllocated)
+    {
+        unsigned int nNewAllocated = ((nPos + nSize) / BLOCKFILE_CHUNK_SIZE + 1) * BLOCKFILE_CHUNK_SIZE;
+        AllocateFileRange(file, nAllocated, nNewAllocated - nAllocated);
+        nAllocated = nNewAllocated;
+    }
+
+    if (fwrite(pch, 1, nSize, file) != nSize || fflush(file) != 0)
+    {
+        // Whatever part did reach the file is ignored by the block index;
+        // reopen to pick the real end back up
+        CloseFile();
+        return error("CBlockFileWriter::Write() : write to %s failed", BlockFilePath(nFile).string());
+    }
+
+    nFileRet = nFile;
+    nPosRet = nPos;
+    nPos += nSize;
+    nUnsynced++;
+    return true;
+}
+
+void CBlockFileWriter::Commit(bool fForce)
+{
+    LOCK(cs);
+
+    if (!file || nUnsynced == 0)
+        return;
+    if (fForce || nUnsynced >= BLOCKFILE_SYNC_INTERVAL)
+    {
+        FileCommit(file);
+        nUnsynced = 0;
+    }
+}
+
+void CBlockFileWriter::Close()
+{
+    LOCK(cs);
+    CloseFile();
+}
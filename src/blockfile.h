@@ -0,0 +1,100 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "sync.h"
+
+#include <map>
+#include <stdio.h>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Maximum number of blk*.dat files kept open for reading */
+static const unsigned int MAX_OPEN_BLOCK_FILES = 64;
+/** Block files grow on disk in chunks of this size (16 MiB) */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000;
+/** Blocks written between fsyncs while the node is still catching up */
+static const unsigned int BLOCKFILE_SYNC_INTERVAL = 500;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile);
+
+/** Read-only descriptor of one block file, closed with the last reference */
+class CBlockFileHandle
+{
+public:
+    int fd;
+
+    explicit CBlockFileHandle(int fdIn) : fd(fdIn) {}
+    ~CBlockFileHandle();
+};
+
+/** Bounded cache of read-only handles to the blk*.dat files, shared by all
+ * block and transaction readers. Reads are positional, so readers on other
+ * threads never see each other's file offset, and the least recently used
+ * file is closed once more than nMaxOpen are in use.
+ */
+class CBlockFileReader
+{
+private:
+    struct CEntry
+    {
+        boost::shared_ptr<CBlockFileHandle> handle;
+        uint64_t nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<unsigned int, CEntry> mapOpen;
+    uint64_t nUseCounter;
+    unsigned int nMaxOpen;
+
+    boost::shared_ptr<CBlockFileHandle> Get(unsigned int nFile);
+
+public:
+    CBlockFileReader(unsigned int nMaxOpenIn) : nUseCounter(0), nMaxOpen(nMaxOpenIn) {}
+
+    /** Read up to nSize bytes at nPos of block file nFile. Returns the number
+     *  of bytes read, which is only short at the end of the file, or -1. */
+    int Read(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize);
+};
+
+/** Appends blocks to the current blk*.dat file. The file stays open between
+ * blocks instead of being reopened and seeked for every write, its space is
+ * reserved ahead in BLOCKFILE_CHUNK_SIZE steps so it does not fragment, and
+ * fsync is left to Commit() so that several blocks can share one.
+ */
+class CBlockFileWriter
+{
+private:
+    CCriticalSection cs;
+    FILE* file;
+    unsigned int nFile;
+    unsigned int nPos;
+    unsigned int nAllocated;
+    unsigned int nUnsynced;
+
+    bool Open();
+    void CloseFile();
+
+public:
+    CBlockFileWriter() : file(NULL), nFile(1), nPos(0), nAllocated(0), nUnsynced(0) {}
+
+    /** Append nSize bytes and hand them to the OS, so that blockFileReader
+     *  sees them right away. Returns the file and offset they were written at. */
+    bool Write(const char* pch, unsigned int nSize, unsigned int& nFileRet, unsigned int& nPosRet);
+
+    /** fsync what has been written; unless fForce, only once every
+     *  BLOCKFILE_SYNC_INTERVAL blocks */
+    void Commit(bool fForce);
+
+    /** Commit and close the current file */
+    void Close();
+};
+
+extern CBlockFileReader blockFileReader;
+extern CBlockFileWriter blockFileWriter;
+
+#endif
@@ -55,7 +55,7 @@ public:
         vAlertPubKey = ParseHex("03cfa298104fee60d22ac8b52ebbb77e82b9acb37a134c83531987f3f0ee4291d0047ae55edeb0981d57e0200aba8297bf343384db4ed2cbaff1981921109ed8e0");
         nDefaultPort = 22064;
         nRPCPort = 22074;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 20);
+        bnProofOfWorkLimit = arith_uint256(~uint256(0) >> 20);
 
         const char* pszTimestamp = "Two Americans among the 207 killed as blasts rock churches, hotels in Sri Lanka on Easter 2019-04-21 USAToday.com";
         std::vector<CTxIn> vin;
@@ -137,7 +137,7 @@ public:
         pchMessageStart[1] = 0xc2;
         pchMessageStart[2] = 0xb1;
         pchMessageStart[3] = 0x72;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 16);
+        bnProofOfWorkLimit = arith_uint256(~uint256(0) >> 16);
         vAlertPubKey = ParseHex("04c629dd98710d15c4f63db4e67247335e09dec8b4ca4c157a23858e2503709e5fe3ba75d5b5263b046ae4b20af135a4dc79e66123ad9a15e65a98798bfee60724");
         nDefaultPort = 48300;
         nRPCPort = 48310;
@@ -203,7 +203,7 @@ public:
         pchMessageStart[1] = 0xa6;
         pchMessageStart[2] = 0xa2;
         pchMessageStart[3] = 0x71;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 1);
+        bnProofOfWorkLimit = arith_uint256(~uint256(0) >> 1);
         genesis.nTime    = 1555864386;
         genesis.nNonce = 527085;
         genesis.nBits  = bnProofOfWorkLimit.GetCompact();
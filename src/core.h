@@ -12,7 +12,13 @@
 
 #include <stdio.h>
 
+#include <boost/shared_ptr.hpp>
+
 class CTransaction;
+class CSharedTransaction;
+
+/** Reference to an immutable transaction, see CSharedTransaction */
+typedef boost::shared_ptr<const CSharedTransaction> CTransactionRef;
 
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
@@ -52,11 +58,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -130,4 +130,25 @@ int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
+/** SipHash-2-4 of a uint256 with the 128 bit key (k0, k1) */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
+/** Hasher for hash tables keyed by block or transaction hashes. The keys
+ * are already uniformly distributed, but peers can still grind them into
+ * one bucket, so they are hashed with a random key chosen per table.
+ */
+class CUint256Hasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CUint256Hasher();
+
+    size_t operator()(const uint256& hash) const
+    {
+        return SipHashUint256(k0, k1, hash);
+    }
+};
+
 #endif
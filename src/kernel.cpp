@@ -6,12 +6,16 @@
 #include <boost/assign/list_of.hpp>
 
 #include "kernel.h"
+#include "arith_uint256.h"
+#include "checkqueue.h"
 #include "txdb.h"
 
 using namespace std;
 
 extern int nStakeMaxAge;
 
+int nStakeThreads = 0;
+
 // Get time weight
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
 {
@@ -51,48 +55,44 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// Candidate block for a stake modifier selection round. The selection hash
+// of a block only depends on its proof-hash and the previous modifier, so it
+// is the same in every round and is computed once per candidate.
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    uint256 hashSelection;
+    const CBlockIndex* pindex;
+    bool fSelected;
+
+    friend bool operator<(const CModifierCandidate& a, const CModifierCandidate& b)
+    {
+        return a.nTime < b.nTime || (a.nTime == b.nTime && a.hashBlock < b.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint256 nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(vector<CModifierCandidate>& vSortedByTimestamp, int64_t nSelectionIntervalStop, const CBlockIndex** pindexSelected)
 {
-    bool fSelected = false;
-    uint256 hashBest = 0;
+    CModifierCandidate* pcandidateBest = NULL;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(CModifierCandidate& item, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (pcandidateBest && item.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (item.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
-        {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
-        {
-            fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
+        if (!pcandidateBest || item.hashSelection < pcandidateBest->hashSelection)
+            pcandidateBest = &item;
     }
-    LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
-    return fSelected;
+    LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", pcandidateBest ? pcandidateBest->hashSelection.ToString() : uint256(0).ToString());
+    if (!pcandidateBest)
+        return false;
+    pcandidateBest->fSelected = true;
+    *pindexSelected = pcandidateBest->pindex;
+    return true;
 }
 
 // Stake Modifier (hash modifier of proof-of-stake):
@@ -127,14 +127,31 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint256& nStakeModi
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / GetTargetSpacing(pindexPrev->nHeight));
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        candidate.fSelected = false;
+
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        CDataStream ss(SER_GETHASH, 0);
+        ss << pindex->hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -144,18 +161,15 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint256& nStakeModi
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint256 nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint256)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -173,11 +187,13 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint256& nStakeModi
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CModifierCandidate& item, vSortedByTimestamp)
         {
+            if (!item.fSelected)
+                continue;
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(item.pindex->nHeight - nHeightFirstCandidate, 1, item.pindex->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -203,40 +219,6 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
     return Hash(ss.begin(), ss.end());
 }
 
-// The stake modifier used to hash for a stake kernel is chosen as the stake
-// modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint256& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
-{
-    nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
-    nStakeModifierHeight = pindexFrom->nHeight;
-    nStakeModifierTime = pindexFrom->GetBlockTime();
-    int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
-    {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + getNStakeMinAge() - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString(), pindex->nHeight, hashBlockFrom.ToString());
-            else
-                return false;
-        }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
-        {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
-    }
-    nStakeModifier = pindex->nStakeModifier;
-    return true;
-}
-
 // GloveCoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -259,24 +241,29 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint256& nStakeModifie
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+arith_uint256 GetStakeTarget(unsigned int nBits, int64_t nValueIn, bool& fAnyHash, bool& fNoHash)
+{
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    arith_uint256 bnWeight((uint64_t)std::max(nValueIn, (int64_t)0));
+    fNoHash = fNegative && nValueIn > 0;
+    fAnyHash = !fNegative && nValueIn > 0 && (fOverflow ||
+        (bnTarget.bits() + bnWeight.bits() > 256 && bnTarget > ~arith_uint256(0) / bnWeight));
+    return bnTarget * bnWeight;
+}
+
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHashV2() : nTime violation");
 
     if (nTimeBlockFrom + getNStakeMinAge() > nTimeTx) // min age requirement
         return error("CheckStakeKernelHashV2() : min age violation");
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
-
-    targetProofOfStake = bnTarget.getuint256();
+    bool fAnyHash, fNoHash;
+    targetProofOfStake = GetStakeTarget(nBits, nValueIn, fAnyHash, fNoHash);
 
     uint256 nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
@@ -285,7 +272,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
     ss << nStakeModifier;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -296,12 +283,12 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=%s nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier.ToString(),
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget)
+    if (fNoHash || (!fAnyHash && hashProofOfStake > targetProofOfStake))
         return false;
 
     if (fDebug && !fPrintProofOfStake)
@@ -312,7 +299,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=%s nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier.ToString(),
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -321,7 +308,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
 
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -393,3 +380,143 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool CacheKernel(StakeCacheMap& cache, CBlockIndex* pindexPrev, const COutPoint& prevout, CTxDB& txdb)
+{
+    if (cache.count(prevout))
+        return true;
+
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    int nDepth;
+    CStakeCache entry;
+    entry.nTimeTxPrev = txPrev.nTime;
+    entry.nTimeBlockFrom = block.GetBlockTime();
+    entry.nValue = txPrev.vout[prevout.n].nValue;
+    entry.fConfirmed = !IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth);
+    cache.insert(make_pair(prevout, entry));
+
+    return true;
+}
+
+/** Best kernel found so far by a FindStakeKernel() run */
+class CStakeKernelSearch
+{
+public:
+    CCriticalSection cs;
+    unsigned int nCoin;
+    unsigned int nTimeTx;
+    bool fFound;
+
+    CStakeKernelSearch() : nCoin(0), nTimeTx(0), fFound(false) {}
+
+    // Whether a kernel of a coin before nCoinIn has already been found
+    bool Superseded(unsigned int nCoinIn)
+    {
+        LOCK(cs);
+        return fFound && nCoin < nCoinIn;
+    }
+
+    void Found(unsigned int nCoinIn, unsigned int nTimeTxIn)
+    {
+        LOCK(cs);
+        if (!fFound || nCoinIn < nCoin)
+        {
+            fFound = true;
+            nCoin = nCoinIn;
+            nTimeTx = nTimeTxIn;
+        }
+    }
+};
+
+bool CStakeKernelCheck::operator()()
+{
+    if (psearch->Superseded(nCoin) || pindexPrev != pindexBest)
+        return true;
+
+    if (nTimeTx < entry.nTimeTxPrev)
+        return true;
+
+    // Weighted target
+    bool fAnyHash, fNoHash;
+    uint256 hashTarget = GetStakeTarget(nBits, entry.nValue, fAnyHash, fNoHash);
+    if (fNoHash)
+        return true;
+
+    CHashWriter ssPrefix(SER_GETHASH, 0);
+    ssPrefix << pindexPrev->nStakeModifier << entry.nTimeTxPrev << prevout.hash << prevout.n;
+
+    for (unsigned int n = 0; n < nSearchInterval; n++)
+    {
+        unsigned int nTime = nTimeTx - n;
+        if (nTime < entry.nTimeTxPrev || entry.nTimeBlockFrom + getNStakeMinAge() > nTime)
+            break; // earlier timestamps will not meet the age rules either
+
+        CHashWriter ss(ssPrefix);
+        ss << nTime;
+        if (fAnyHash || ss.GetHash() <= hashTarget)
+        {
+            psearch->Found(nCoin, nTime);
+            break;
+        }
+    }
+    return true;
+}
+
+static CCheckQueue<CStakeKernelCheck> stakekernelqueue(4);
+
+void ThreadStakeKernelCheck()
+{
+    RenameThread("glovecoin-stakehash");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    stakekernelqueue.Thread();
+}
+
+bool FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const vector<COutPoint>& vPrevouts, unsigned int nStart,
+                     const StakeCacheMap& cache, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     unsigned int& nCoinRet, unsigned int& nTimeTxRet)
+{
+    CStakeKernelSearch search;
+    vector<CStakeKernelCheck> vChecks;
+    vChecks.reserve(vPrevouts.size());
+    for (unsigned int i = nStart; i < vPrevouts.size(); i++)
+    {
+        StakeCacheMap::const_iterator it = cache.find(vPrevouts[i]);
+        if (it == cache.end() || !it->second.fConfirmed)
+            continue;
+        vChecks.push_back(CStakeKernelCheck(pindexPrev, nBits, vPrevouts[i], it->second, i, nTimeTx, nSearchInterval, &search));
+    }
+
+    if (nStakeThreads)
+    {
+        // The queue hands out its tail first, queue the low coin indices last
+        // so that they are searched first
+        reverse(vChecks.begin(), vChecks.end());
+        CCheckQueueControl<CStakeKernelCheck> control(&stakekernelqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+    else
+    {
+        BOOST_FOREACH(CStakeKernelCheck& check, vChecks)
+        {
+            boost::this_thread::interruption_point();
+            check();
+        }
+    }
+
+    if (!search.fFound)
+        return false;
+
+    nCoinRet = search.nCoin;
+    nTimeTxRet = search.nTimeTx;
+    return true;
+}
@@ -4,6 +4,7 @@
 #ifndef PPCOIN_KERNEL_H
 #define PPCOIN_KERNEL_H
 
+#include "arith_uint256.h"
 #include "main.h"
 
 // To decrease granularity of timestamp
@@ -32,6 +33,12 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx);
 
+// Weighted stake target: the compact target nBits times the value of the
+// staked coin. The product is returned modulo 2^256; fAnyHash is set when it
+// does not fit, so that every hash meets it, and fNoHash for a negative
+// target that no hash meets.
+arith_uint256 GetStakeTarget(unsigned int nBits, int64_t nValueIn, bool& fAnyHash, bool& fNoHash);
+
 // Get time weight using supplied timestamps
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 
@@ -40,4 +47,74 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+/** Kernel inputs of one staking coin. Everything here is read from disk once
+ *  and stays valid for as long as the chain tip the entry was built on. */
+struct CStakeCache
+{
+    unsigned int nTimeTxPrev;
+    int64_t nTimeBlockFrom;
+    int64_t nValue;
+    bool fConfirmed; // has nStakeMinConfirmations at the tip
+};
+
+typedef std::map<COutPoint, CStakeCache> StakeCacheMap;
+
+// Add the kernel inputs of prevout to the cache unless already present
+bool CacheKernel(StakeCacheMap& cache, CBlockIndex* pindexPrev, const COutPoint& prevout, CTxDB& txdb);
+
+/** Searches one staking coin for a kernel over a range of timestamps.
+ *  The kernel hash of a coin only differs in the last four bytes between
+ *  timestamps, so the hash state after the constant prefix is computed once
+ *  and copied for every timestamp. Results go to a shared CStakeKernelSearch.
+ */
+class CStakeKernelSearch;
+class CStakeKernelCheck
+{
+private:
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    COutPoint prevout;
+    CStakeCache entry;
+    unsigned int nCoin;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    CStakeKernelSearch* psearch;
+
+public:
+    CStakeKernelCheck() : pindexPrev(NULL), psearch(NULL) {}
+    CStakeKernelCheck(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, const COutPoint& prevoutIn, const CStakeCache& entryIn,
+                      unsigned int nCoinIn, unsigned int nTimeTxIn, unsigned int nSearchIntervalIn, CStakeKernelSearch* psearchIn) :
+        pindexPrev(pindexPrevIn), nBits(nBitsIn), prevout(prevoutIn), entry(entryIn),
+        nCoin(nCoinIn), nTimeTx(nTimeTxIn), nSearchInterval(nSearchIntervalIn), psearch(psearchIn) {}
+
+    bool operator()();
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pindexPrev, check.pindexPrev);
+        std::swap(nBits, check.nBits);
+        std::swap(prevout, check.prevout);
+        std::swap(entry, check.entry);
+        std::swap(nCoin, check.nCoin);
+        std::swap(nTimeTx, check.nTimeTx);
+        std::swap(nSearchInterval, check.nSearchInterval);
+        std::swap(psearch, check.psearch);
+    }
+};
+
+static const int MAX_STAKE_THREADS = 16;
+
+// Number of threads hashing stake kernels, 0 = search on the stake thread only
+extern int nStakeThreads;
+
+// Worker thread for the stake kernel search queue
+void ThreadStakeKernelCheck();
+
+// Search vPrevouts[nStart..] for a kernel with a timestamp in
+// (nTimeTx - nSearchInterval, nTimeTx]. Returns the kernel of the lowest
+// coin index, at the latest timestamp that coin has one.
+bool FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<COutPoint>& vPrevouts, unsigned int nStart,
+                     const StakeCacheMap& cache, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     unsigned int& nCoinRet, unsigned int& nTimeTxRet);
+
 #endif // PPCOIN_KERNEL_H
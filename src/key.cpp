@@ -8,6 +8,7 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -523,6 +524,12 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+    // Native engine first; anything it does not handle goes to OpenSSL
+    if (!vchSig.empty()) {
+        int ret = secp256k1::Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), begin(), size());
+        if (ret != secp256k1::UNSUPPORTED)
+            return ret == secp256k1::VALID;
+    }
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
@@ -534,8 +541,20 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
+    int rec = (vchSig[0] - 27) & ~4;
+    if (rec >= 0 && rec < 3) {
+        unsigned char pub[65];
+        size_t publen = 0;
+        int ret = secp256k1::Recover((const unsigned char*)&hash, &vchSig[1], rec, (vchSig[0] - 27) & 4, pub, publen);
+        if (ret == secp256k1::VALID) {
+            Set(pub, pub + publen);
+            return true;
+        }
+        if (ret == secp256k1::INVALID)
+            return false;
+    }
     CECKey key;
-    if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
+    if (!key.Recover(hash, &vchSig[1], rec))
         return false;
     key.GetPubKey(*this, (vchSig[0] - 27) & 4);
     return true;
@@ -546,8 +565,18 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
         return false;
     if (vchSig.size() != 65)
         return false;
+    int rec = (vchSig[0] - 27) & ~4;
+    if (rec >= 0 && rec < 3) {
+        unsigned char pub[65];
+        size_t publen = 0;
+        int ret = secp256k1::Recover((const unsigned char*)&hash, &vchSig[1], rec, IsCompressed(), pub, publen);
+        if (ret == secp256k1::VALID)
+            return publen == size() && memcmp(pub, begin(), publen) == 0;
+        if (ret == secp256k1::INVALID)
+            return false;
+    }
     CECKey key;
-    if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
+    if (!key.Recover(hash, &vchSig[1], rec))
         return false;
     CPubKey pubkeyRec;
     key.GetPubKey(pubkeyRec, IsCompressed());
@@ -709,6 +738,25 @@ bool ECC_InitSanityCheck() {
         return false;
     EC_KEY_free(pkey);
 
+    // Cross-check the native verifier against OpenSSL signatures
+    if (secp256k1::IsEnabled()) {
+        CKey key;
+        key.MakeNewKey(true);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = Hash(pubkey.begin(), pubkey.end());
+        std::vector<unsigned char> vchSig;
+        if (!key.Sign(hash, vchSig))
+            return false;
+        if (secp256k1::Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), pubkey.begin(), pubkey.size()) != secp256k1::VALID)
+            return false;
+        hash ^= 1;
+        if (secp256k1::Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), pubkey.begin(), pubkey.size()) != secp256k1::INVALID)
+            return false;
+        CPubKey pubkeyRec;
+        if (!key.SignCompact(hash, vchSig) || !pubkeyRec.RecoverCompact(hash, vchSig) || pubkeyRec != pubkey)
+            return false;
+    }
+
     // TODO Is there more EC functionality that could be missing?
     return true;
 }
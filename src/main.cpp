@@ -8,9 +8,11 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "alert.h"
+#include "arith_uint256.h"
 #include "base58.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -36,11 +38,13 @@ set<CWallet*> setpwalletRegistered;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CCoinsCache coinsCache;
+CStakeWeightStats stakeWeightStats;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
+arith_uint256 bnProofOfStakeLimit(~uint256(0) >> 20);
 
 int nStakeMinConfirmations = 10;
 unsigned int nStakeMaxAge = 3 * (60 * 60 * 24); // 3 days
@@ -55,10 +59,13 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
+CBlockIndexArena blockIndexArena;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
 struct COrphanBlock {
 	uint256 hashBlock;
@@ -66,7 +73,7 @@ struct COrphanBlock {
 	std::pair<COutPoint, unsigned int> stake;
 	vector<unsigned char> vchBlock;
 };
-map<uint256, COrphanBlock*> mapOrphanBlocks;
+OrphanBlockMap mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 size_t nOrphanBlocksSize = 0;
@@ -74,6 +81,29 @@ size_t nOrphanBlocksSize = 0;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// Headers-first sync: headers accepted ahead of their blocks, indexed by
+// height and by parent, the header chain the blocks are downloaded along,
+// and the peer each requested block is expected from. Every header's parent
+// is either another entry or in mapBlockIndex.
+struct CBlockHeaderEntry
+{
+	uint256 hashPrev;
+	int nHeight;
+	unsigned int nTime;
+	CNode* pfrom; // the peer that sent it first
+};
+map<uint256, CBlockHeaderEntry> mapBlockHeaders;
+multimap<int, uint256> mapBlockHeadersByHeight;
+multimap<uint256, uint256> mapBlockHeadersByPrev;
+map<int, uint256> mapHeaderChain;
+uint256 hashBestHeader = 0;
+int nBestHeaderHeight = -1;
+unsigned int nHeaderChainVersion = 0; // bumped whenever headers are removed or the header chain moves
+mruset<uint256> setFailedHeaders(1000); // headers whose block turned out invalid
+map<uint256, CNode*> mapBlocksInFlight;
+
+void static ForgetBlockHeader(const uint256& hash);
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -144,16 +174,20 @@ void ResendWalletTransactions(bool fForce) {
 // Registration of network node signals.
 //
 
+void static FinalizeNode(CNode* pnode);
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
 	nodeSignals.ProcessMessages.connect(&ProcessMessages);
 	nodeSignals.SendMessages.connect(&SendMessages);
+	nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
 	nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
 	nodeSignals.SendMessages.disconnect(&SendMessages);
+	nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
@@ -238,12 +272,64 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 // CTransaction and CTxIndex
 //
 
+// Size of a stored block, kept right in front of it
+bool static ReadStoredBlockSize(unsigned int nFile, unsigned int nBlockPos, unsigned int& nSizeRet)
+{
+	if (nBlockPos < sizeof(nSizeRet))
+		return error("ReadStoredBlockSize() : bad block position");
+	if (blockFileReader.Read(nFile, nBlockPos - sizeof(nSizeRet), (char*)&nSizeRet, sizeof(nSizeRet)) != sizeof(nSizeRet))
+		return error("ReadStoredBlockSize() : read failed");
+	if (nSizeRet > MAX_BLOCK_SIZE)
+		return error("ReadStoredBlockSize() : bad block size %u", nSizeRet);
+	return true;
+}
+
+bool CTransaction::ReadFromDisk(CDiskTxPos pos)
+{
+	// Most transactions are small, so try a short read first. The index does
+	// not store their size, so a larger one is read in doubling steps up to
+	// the end of its block, which reads at most twice its size.
+	unsigned int nReadSize = 4096;
+	unsigned int nMaxSize = 0;
+	while (true)
+	{
+		CDataStream ssTx(SER_DISK, CLIENT_VERSION);
+		ssTx.resize(nReadSize);
+		int nRead = blockFileReader.Read(pos.nFile, pos.nTxPos, &ssTx[0], nReadSize);
+		if (nRead < 0)
+			return error("CTransaction::ReadFromDisk() : read failed");
+		ssTx.resize(nRead);
+
+		try {
+			ssTx >> *this;
+			return true;
+		}
+		catch (std::exception &e) {
+			if ((unsigned int)nRead < nReadSize)
+				return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+		}
+
+		if (nMaxSize == 0)
+		{
+			unsigned int nBlockSize;
+			if (!ReadStoredBlockSize(pos.nFile, pos.nBlockPos, nBlockSize))
+				return error("CTransaction::ReadFromDisk() : ReadStoredBlockSize failed");
+			if (pos.nTxPos < pos.nBlockPos || pos.nTxPos >= pos.nBlockPos + nBlockSize)
+				return error("CTransaction::ReadFromDisk() : bad transaction position");
+			nMaxSize = pos.nBlockPos + nBlockSize - pos.nTxPos;
+		}
+		if (nReadSize >= nMaxSize)
+			return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+		nReadSize = std::min(2 * nReadSize, nMaxSize);
+	}
+}
+
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
 	SetNull();
 	if (!txdb.ReadTxIndex(prevout.hash, txindexRet))
 		return false;
-	if (!ReadFromDisk(txindexRet.pos))
+	if (!coinsCache.ReadTx(prevout.hash, txindexRet.pos, *this))
 		return false;
 	if (prevout.n >= vout.size())
 	{
@@ -266,6 +352,92 @@ bool CTransaction::ReadFromDisk(COutPoint prevout)
 	return ReadFromDisk(txdb, prevout, txindex);
 }
 
+void CCoinsCache::SetMaxSize(size_t nMaxSizeIn)
+{
+	LOCK(cs);
+	nMaxSize = nMaxSizeIn;
+	Trim();
+}
+
+void CCoinsCache::Trim()
+{
+	while (nSize > nMaxSize && !listLRU.empty())
+	{
+		map<uint256, CEntry>::iterator mi = mapEntries.find(listLRU.back());
+		nSize -= mi->second.nSize;
+		mapEntries.erase(mi);
+		listLRU.pop_back();
+	}
+}
+
+void CCoinsCache::Add(const uint256& hash, const CTransaction& tx, const CDiskTxPos& pos, unsigned int nBlockTime)
+{
+	// Rough footprint: serialized transaction plus container overhead
+	unsigned int nEntrySize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) + 64 * (tx.vin.size() + tx.vout.size()) + 160;
+
+	LOCK(cs);
+	map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+	if (mi != mapEntries.end())
+	{
+		nSize -= mi->second.nSize;
+		listLRU.erase(mi->second.itLRU);
+	}
+	else
+		mi = mapEntries.insert(make_pair(hash, CEntry())).first;
+
+	CEntry& entry = mi->second;
+	entry.tx = tx;
+	entry.pos = pos;
+	entry.nBlockTime = nBlockTime;
+	entry.nSize = nEntrySize;
+	entry.itLRU = listLRU.insert(listLRU.begin(), hash);
+	nSize += nEntrySize;
+	Trim();
+}
+
+bool CCoinsCache::ReadTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+	{
+		LOCK(cs);
+		map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+		if (mi != mapEntries.end() && mi->second.pos == pos)
+		{
+			listLRU.splice(listLRU.begin(), listLRU, mi->second.itLRU);
+			tx = mi->second.tx;
+			return true;
+		}
+	}
+
+	if (!tx.ReadFromDisk(pos))
+		return false;
+	Add(hash, tx, pos);
+	return true;
+}
+
+bool CCoinsCache::ReadBlockTime(const uint256& hash, const CDiskTxPos& pos, unsigned int& nBlockTime)
+{
+	{
+		LOCK(cs);
+		map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+		if (mi != mapEntries.end() && mi->second.pos == pos && mi->second.nBlockTime != 0)
+		{
+			nBlockTime = mi->second.nBlockTime;
+			return true;
+		}
+	}
+
+	CBlock block;
+	if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
+		return false;
+	nBlockTime = block.nTime;
+
+	LOCK(cs);
+	map<uint256, CEntry>::iterator mi = mapEntries.find(hash);
+	if (mi != mapEntries.end() && mi->second.pos == pos)
+		mi->second.nBlockTime = nBlockTime;
+	return true;
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
 	if (tx.nVersion > CTransaction::CURRENT_VERSION || tx.nVersion < 1) {
@@ -512,7 +684,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 	vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
 	// Is the tx in a block that's in the main chain
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -737,7 +909,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 	}
 
 	// Store transaction in memory
-	pool.addUnchecked(hash, tx);
+	pool.addUnchecked(hash, MakeTransactionRef(tx));
 
 	SyncWithWallets(tx, NULL);
 
@@ -757,7 +929,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 	AssertLockHeld(cs_main);
 
 	// Find the block it claims to be in
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -833,7 +1005,7 @@ int CTxIndex::GetDepthInMainChain() const
 	if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
 		return 0;
 	// Find the block in the index
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+	BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -878,22 +1050,45 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-	CBlockIndex *pblockindex;
-	if (nHeight < nBestHeight / 2)
-		pblockindex = pindexGenesisBlock;
-	else
-		pblockindex = pindexBest;
-	if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-		pblockindex = pblockindexFBBHLast;
-	while (pblockindex->nHeight > nHeight)
-		pblockindex = pblockindex->pprev;
-	while (pblockindex->nHeight < nHeight)
-		pblockindex = pblockindex->pnext;
-	pblockindexFBBHLast = pblockindex;
-	return pblockindex;
+	return chainActive[nHeight];
+}
+
+void CChain::SetTip(CBlockIndex* pindex)
+{
+	if (pindex == NULL) {
+		vChain.clear();
+		return;
+	}
+	vChain.resize(pindex->nHeight + 1);
+	while (pindex && vChain[pindex->nHeight] != pindex) {
+		vChain[pindex->nHeight] = pindex;
+		pindex = pindex->pprev;
+	}
+}
+
+void* CBlockIndexArena::Allocate()
+{
+	// 4096 entries, about 1 MB per chunk
+	static const size_t nChunkSize = 4096;
+	if (vChunks.empty() || nChunkUsed == nChunkSize)
+	{
+		vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * nChunkSize)));
+		nChunkUsed = 0;
+	}
+	return vChunks.back() + nChunkUsed++;
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+	if (pindex == NULL)
+		return NULL;
+	while (pindex->nHeight > Height())
+		pindex = pindex->pprev;
+	while (pindex && !Contains(pindex))
+		pindex = pindex->pprev;
+	return pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -910,15 +1105,73 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 	return true;
 }
 
+void PrecomputeBlockHashes(std::vector<CBlock>& vblock)
+{
+	// Only legacy headers are identified by their scrypt hash
+	std::vector<unsigned char> vchHeaders;
+	std::vector<CBlock*> vpblock;
+	BOOST_FOREACH(CBlock& block, vblock)
+	{
+		if (block.nVersion > 6)
+			continue;
+		vpblock.push_back(&block);
+		vchHeaders.insert(vchHeaders.end(), BEGIN(block.nVersion), END(block.nNonce));
+	}
+	if (vpblock.empty())
+		return;
+
+	std::vector<uint256> vhash(vpblock.size());
+	scrypt_blockhash_batch(&vchHeaders[0], vpblock.size(), &vhash[0]);
+	for (unsigned int i = 0; i < vpblock.size(); i++)
+		vpblock[i]->SetCachedHash(vhash[i]);
+}
+
+bool ReadBlocksFromDisk(const std::vector<CBlockIndex*>& vpindex, std::vector<CBlock>& vblock)
+{
+	vblock.resize(vpindex.size());
+	for (unsigned int i = 0; i < vpindex.size(); i++)
+		if (!vblock[i].ReadFromDisk(vpindex[i]->nFile, vpindex[i]->nBlockPos, true, false))
+			return false;
+
+	PrecomputeBlockHashes(vblock);
+
+	for (unsigned int i = 0; i < vpindex.size(); i++)
+	{
+		const CBlock& block = vblock[i];
+		if (block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+			return error("ReadBlocksFromDisk() : errors in block header");
+		if (block.GetHash() != vpindex[i]->GetBlockHash())
+			return error("ReadBlocksFromDisk() : GetHash() doesn't match index");
+	}
+	return true;
+}
+
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos)
+{
+	unsigned int nSize;
+	if (!ReadStoredBlockSize(nFile, nBlockPos, nSize))
+		return error("ReadRawBlockFromDisk() : ReadStoredBlockSize failed");
+
+	ssBlock.resize(nSize);
+	if (nSize > 0 && blockFileReader.Read(nFile, nBlockPos, &ssBlock[0], nSize) != (int)nSize)
+		return error("ReadRawBlockFromDisk() : read failed");
+	return true;
+}
+
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex)
+{
+	return ReadRawBlockFromDisk(ssBlock, pindex->nFile, pindex->nBlockPos);
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
-	map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
+	OrphanBlockMap::iterator it = mapOrphanBlocks.find(hash);
 	if (it == mapOrphanBlocks.end())
 		return hash;
 
 	// Work back to the first block in the orphan chain
 	do {
-		map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
+		OrphanBlockMap::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
 		if (it2 == mapOrphanBlocks.end())
 			return it->first;
 		it = it2;
@@ -962,7 +1215,7 @@ void static PruneOrphanBlocks()
 	}
 }
 
-static CBigNum GetProofOfStakeLimit(int nHeight)
+static arith_uint256 GetProofOfStakeLimit(int nHeight)
 {
 	return bnProofOfStakeLimit;
 }
@@ -1022,31 +1275,33 @@ uint64_t GetProofOfStakeReward(int nHeight, uint64_t nCoinAge, int64_t nFees)
 	return nSubsidy;
 }
 
-CBigNum GetWeightSpent(CBlockIndex* pindex)
+// Coin-days a coinstake spends, in whole days and whole coins
+static int64_t GetWeightSpent(int64_t nTimeBlock, const CTransaction& txPrev, unsigned int nOut)
 {
-	if (pindex->IsProofOfWork())
-		return 0;
+	unsigned int nAge = min(nTimeBlock - txPrev.nTime, (int64_t)nStakeMaxAge);
 
-	CBlock block;
-	if (!block.ReadFromDisk(pindex, true))
-		return 0;
+	uint64_t nAmount = txPrev.vout[nOut].nValue;
 
-	// get staked txin
-	CTxIn txInStake = block.vtx[1].vin[0];
+	return (nAge / 86400) * (nAmount/COIN);
+}
 
-	// load the txin transaction.
-	CTxDB txdb("r");
-	CTransaction txPrev;
-	if (!txdb.ReadDiskTx(txInStake.prevout, txPrev))
+CBigNum GetWeightSpent(CBlockIndex* pindex)
+{
+	if (pindex->IsProofOfWork())
 		return 0;
 
-	unsigned int nAge = block.GetBlockTime() - txPrev.nTime;
-
-	nAge = min(block.GetBlockTime() - txPrev.nTime, (int64_t)nStakeMaxAge);
+	if (pindex->nStakeWeightSpent < 0)
+	{
+		// load the staked txin transaction, the block index knows which one it is
+		CTxDB txdb("r");
+		CTransaction txPrev;
+		if (!txdb.ReadDiskTx(pindex->prevoutStake, txPrev))
+			return 0;
 
-	uint64_t nAmount = txPrev.vout[txInStake.prevout.n].nValue;
+		pindex->nStakeWeightSpent = GetWeightSpent(pindex->GetBlockTime(), txPrev, pindex->prevoutStake.n);
+	}
 
-	return CBigNum((nAge / 86400) * (nAmount/COIN));
+	return CBigNum(pindex->nStakeWeightSpent);
 }
 
 CBigNum GetAverageWeightOverPeriod(int nBlocksCount)
@@ -1064,15 +1319,81 @@ CBigNum GetAverageWeightOverPeriod(int nBlocksCount)
 	while (pindex->nHeight > nEndHeight -1) {
 		bnWeight = GetWeightSpent(pindex);
 		if (bnWeight > 0) {
-			bnWeightSpent += GetWeightSpent(pindex);
+			bnWeightSpent += bnWeight;
 			nCount++;
 		}
 		pindex = pindex->pprev;
 	}
 
+	if (nCount == 0)
+		return 0;
+
 	return bnWeightSpent/nCount;
 }
 
+void CStakeWeightStats::Add(uint64_t nWeight)
+{
+	if (nWeight > 0) {
+		nWeightSpent += nWeight;
+		nStakes++;
+	}
+}
+
+void CStakeWeightStats::Remove(uint64_t nWeight)
+{
+	if (nWeight > 0) {
+		nWeightSpent -= nWeight;
+		nStakes--;
+	}
+}
+
+void CStakeWeightStats::SetTip(CBlockIndex* pindexNew)
+{
+	AssertLockHeld(cs_main);
+	LOCK(cs);
+
+	// Drop the blocks that were disconnected; blocks of the best chain
+	// either have a successor or are the new tip
+	while (!vWindow.empty() && vWindow.back().first != pindexNew && !vWindow.back().first->pnext)
+	{
+		Remove(vWindow.back().second);
+		vWindow.pop_back();
+	}
+
+	// Add the blocks connected since the last update
+	CBlockIndex* pindex = vWindow.empty() ? pindexNew : NULL;
+	if (!vWindow.empty() && vWindow.back().first != pindexNew)
+		pindex = vWindow.back().first->pnext;
+	for (; pindex; pindex = (pindex == pindexNew ? NULL : pindex->pnext))
+	{
+		uint64_t nWeight = GetWeightSpent(pindex).getuint64();
+		vWindow.push_back(make_pair(pindex, nWeight));
+		Add(nWeight);
+	}
+
+	// Keep exactly the last STAKE_WEIGHT_WINDOW blocks
+	while (vWindow.size() > (size_t)STAKE_WEIGHT_WINDOW)
+	{
+		Remove(vWindow.front().second);
+		vWindow.pop_front();
+	}
+	while (vWindow.size() < (size_t)STAKE_WEIGHT_WINDOW && vWindow.front().first->pprev)
+	{
+		pindex = vWindow.front().first->pprev;
+		uint64_t nWeight = GetWeightSpent(pindex).getuint64();
+		vWindow.push_front(make_pair(pindex, nWeight));
+		Add(nWeight);
+	}
+}
+
+uint64_t CStakeWeightStats::GetAverage(int* pnStakes)
+{
+	LOCK(cs);
+	if (pnStakes)
+		*pnStakes = nStakes;
+	return nStakes ? nWeightSpent / nStakes : 0;
+}
+
 static const int64_t nTargetTimespan = 16 * 60;  // 16 mins
 
 // ppcoin: find last block index up to pindex
@@ -1085,7 +1406,7 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-	CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
+	arith_uint256 bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
 
 	if (pindexLast == NULL)
 		return bnTargetLimit.GetCompact(); // genesis block
@@ -1104,13 +1425,25 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 	// ppcoin: target change every block
 	// ppcoin: retarget with exponential moving toward target spacing
-	CBigNum bnNew;
-	bnNew.SetCompact(pindexPrev->nBits);
 	int64_t nInterval = nTargetTimespan / nTargetSpacing;
-	bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-	bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-	if (bnNew <= 0 || bnNew > bnTargetLimit)
+	int64_t nNumerator = (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing;
+	int64_t nDenominator = (nInterval + 1) * nTargetSpacing;
+	bool fNegative, fOverflow;
+	arith_uint256 bnPrev;
+	bnPrev.SetCompact(pindexPrev->nBits, &fNegative, &fOverflow);
+	if (nNumerator <= 0 || fNegative || fOverflow || bnPrev == 0)
+		return bnTargetLimit.GetCompact();
+
+	// bnPrev * nNumerator / nDenominator, split up so that the product cannot
+	// overflow: whenever the quotient part alone exceeds the limit, so does the
+	// result
+	arith_uint256 bnQuotient = bnPrev / (uint64_t)nDenominator;
+	arith_uint256 bnRemainder = bnPrev - bnQuotient * (uint64_t)nDenominator;
+	if (bnQuotient > bnTargetLimit / (uint64_t)nNumerator)
+		return bnTargetLimit.GetCompact();
+	arith_uint256 bnNew = bnQuotient * (uint64_t)nNumerator + bnRemainder * (uint64_t)nNumerator / (uint64_t)nDenominator;
+
+	if (bnNew == 0 || bnNew > bnTargetLimit)
 		bnNew = bnTargetLimit;
 
 	return bnNew.GetCompact();
@@ -1118,15 +1451,16 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-	CBigNum bnTarget;
-	bnTarget.SetCompact(nBits);
+	bool fNegative, fOverflow;
+	arith_uint256 bnTarget;
+	bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
 	// Check range
-	if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit())
+	if (fNegative || fOverflow || bnTarget == 0 || bnTarget > Params().ProofOfWorkLimit())
 		return error("CheckProofOfWork() : nBits below minimum work");
 
 	// Check proof of work matches claimed amount
-	if (hash > bnTarget.getuint256())
+	if (hash > bnTarget)
 		return error("CheckProofOfWork() : hash doesn't match nBits");
 
 	return true;
@@ -1234,7 +1568,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-							   bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+							   bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
 	// FetchInputs can return false either because we just haven't seen some inputs
 	// (in which case the transaction should be stored as an orphan)
@@ -1279,8 +1613,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
 		}
 		else
 		{
-			// Get prev tx from disk
-			if (!txPrev.ReadFromDisk(txindex.pos))
+			// Get prev tx from the coins cache or disk
+			if (!coinsCache.ReadTx(prevout.hash, txindex.pos, txPrev))
 				return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
 		}
 	}
@@ -1331,8 +1665,14 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const
+{
+	const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+	return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType);
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-	const CBlockIndex* pindexBlock, uint64_t &nBurnCoins, bool fBlock, bool fMiner, unsigned int flags)
+	const CBlockIndex* pindexBlock, uint64_t &nBurnCoins, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks) const
 {
 	// Take over previous transactions' spent pointers
 	// fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1395,7 +1735,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 			if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
 			{
 				// Verify signature
-				if (!VerifySignature(txPrev, *this, i, flags, 0))
+				CScriptCheck check(txPrev, *this, i, flags, 0);
+				if (pvChecks)
+				{
+					pvChecks->push_back(CScriptCheck());
+					check.swap(pvChecks->back());
+				}
+				else if (!check())
 				{
 					if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
 						// Check whether the failure was caused by a
@@ -1462,6 +1808,14 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 	return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+	RenameThread("GloveCoin-scriptch");
+	scriptcheckqueue.Thread();
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
 	// Disconnect in reverse order
@@ -1509,6 +1863,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 	else
 		nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+	CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
 	map<uint256, CTxIndex> mapQueuedChanges;
 	int64_t nFees = 0;
 	int64_t nValueIn = 0;
@@ -1570,15 +1926,28 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 			if (!tx.IsCoinStake())
 				nFees += nTxValueIn - nTxValueOut;
 			if (tx.IsCoinStake())
+			{
 				nStakeReward = nTxValueOut - nTxValueIn;
+				if (!fJustCheck)
+				{
+					const COutPoint& prevout = tx.vin[0].prevout;
+					pindex->nStakeWeightSpent = GetWeightSpent(GetBlockTime(), mapInputs[prevout.hash].second, prevout.n);
+				}
+			}
 
-			if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, nBurnCoins, true, false, flags))
+			std::vector<CScriptCheck> vChecks;
+			if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, nBurnCoins, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
 				return false;
+			control.Add(vChecks);
 		}
 
 		mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
 	}
 
+	// Wait for all queued script checks before anything is written back
+	if (!control.Wait())
+		return DoS(100, error("ConnectBlock() : script verification failed"));
+
 	if (nBurnCoins > 0 && fDebug) {
 		LogPrintf("ConnectBlock() : burning coins %s\n", FormatMoney(nBurnCoins));
 	}
@@ -1654,6 +2023,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 			return error("ConnectBlock() : UpdateTxIndex failed");
 	}
 
+	// New outputs are the likeliest to be spent soon, keep them in memory
+	BOOST_FOREACH(const CTransaction& tx, vtx)
+	{
+		uint256 hashTx = tx.GetHash();
+		coinsCache.Add(hashTx, tx, mapQueuedChanges[hashTx].pos, nTime);
+	}
+
 	// Update block index on disk without changing it in memory.
 	// The memory index structure will be changed after the db commits.
 	if (pindex->pprev)
@@ -1676,18 +2052,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 	LogPrintf("REORGANIZE\n");
 
 	// Find the fork
-	CBlockIndex* pfork = pindexBest;
-	CBlockIndex* plonger = pindexNew;
-	while (pfork != plonger)
-	{
-		while (plonger->nHeight > pfork->nHeight)
-			if (!(plonger = plonger->pprev))
-				return error("Reorganize() : plonger->pprev is null");
-		if (pfork == plonger)
-			break;
-		if (!(pfork = pfork->pprev))
-			return error("Reorganize() : pfork->pprev is null");
-	}
+	CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+	if (!pfork)
+		return error("Reorganize() : no fork with the best chain");
 
 	// List of what to disconnect
 	vector<CBlockIndex*> vDisconnect;
@@ -1742,7 +2109,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 	if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
 		return error("Reorganize() : WriteHashBestChain failed");
 
-	// Make sure it's successfully written to disk before changing memory structure
+	// Make sure it's successfully written to disk before changing memory
+	// structure, block data first so that the index never points past it
+	blockFileWriter.Commit(true);
 	if (!txdb.TxnCommit())
 		return error("Reorganize() : TxnCommit failed");
 
@@ -1755,6 +2124,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 	BOOST_FOREACH(CBlockIndex* pindex, vConnect)
 		if (pindex->pprev)
 			pindex->pprev->pnext = pindex;
+	chainActive.SetTip(pindexNew);
 
 	// Resurrect memory transactions that were in the disconnected branch
 	BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1784,11 +2154,15 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 		InvalidChainFound(pindexNew);
 		return false;
 	}
+	// Blocks off the best chain share batched fsyncs, but the block data
+	// must be on disk before the index records it as the tip
+	blockFileWriter.Commit(true);
 	if (!txdb.TxnCommit())
 		return error("SetBestChain() : TxnCommit failed");
 
 	// Add to current best branch
 	pindexNew->pprev->pnext = pindexNew;
+	chainActive.SetTip(pindexNew);
 
 	// Delete redundant memory transactions
 	BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1807,6 +2181,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 	if (pindexGenesisBlock == NULL && hash == Params().HashGenesisBlock())
 	{
 		txdb.WriteHashBestChain(hash);
+		blockFileWriter.Commit(true);
 		if (!txdb.TxnCommit())
 			return error("SetBestChain() : TxnCommit failed");
 		pindexGenesisBlock = pindexNew;
@@ -1873,11 +2248,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 	// New best block
 	hashBestChain = hash;
 	pindexBest = pindexNew;
-	pblockindexFBBHLast = NULL;
+	chainActive.SetTip(pindexNew);
 	nBestHeight = pindexBest->nHeight;
 	nBestChainTrust = pindexNew->nChainTrust;
 	nTimeBestReceived = GetTime();
 	mempool.AddTransactionsUpdated(1);
+	stakeWeightStats.SetTip(pindexBest);
 
 	uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -1941,12 +2317,12 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
 		if (nTime < txPrev.nTime)
 			return false;  // Transaction timestamp violation
 
-		// read block header
-		CBlock block;
-		if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+		// read block time
+		unsigned int nBlockTime;
+		if (!coinsCache.ReadBlockTime(txin.prevout.hash, txindex.pos, nBlockTime))
 			return false; // could not read block of previous transactions
-		if (block.GetBlockTime() + getNStakeMinAge() > nTime) {
-			LogPrint("coinage", "coin age skip check=%d nTime=%d\n", block.GetBlockTime() + getNStakeMinAge(), nTime);
+		if ((int64_t)nBlockTime + getNStakeMinAge() > nTime) {
+			LogPrint("coinage", "coin age skip check=%d nTime=%d\n", (int64_t)nBlockTime + getNStakeMinAge(), nTime);
 			continue; // count only coins meeting min age requirement
 		}
 
@@ -1969,6 +2345,8 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
 	return true;
 }
 
+bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS);
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof)
 {
 	AssertLockHeld(cs_main);
@@ -1979,11 +2357,10 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 		return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
 	// Construct new block index object
-	CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-	if (!pindexNew)
-		return error("AddToBlockIndex() : new CBlockIndex failed");
+	CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex(nFile, nBlockPos, *this);
+	ForgetBlockHeader(hash);
 	pindexNew->phashBlock = &hash;
-	map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+	BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
 	if (miPrev != mapBlockIndex.end())
 	{
 		pindexNew->pprev = (*miPrev).second;
@@ -2000,6 +2377,11 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 	// Record proof hash value
 	pindexNew->hashProof = hashProof;
 
+	// ProcessBlock normalizes the signature before the block is stored, so
+	// it can be served straight from disk
+	if (IsCanonicalBlockSignature(this, true))
+		pindexNew->nFlags |= CBlockIndex::BLOCK_LOW_S_SIG;
+
 	// ppcoin: compute stake modifier
 	uint256 nStakeModifier = 0;
 	bool fGeneratedStakeModifier = false;
@@ -2009,7 +2391,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 	pindexNew->nStakeModifier = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
 	// Add to mapBlockIndex
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+	BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 	if (pindexNew->IsProofOfStake())
 		setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 	pindexNew->phashBlock = &((*mi).first);
@@ -2046,6 +2428,9 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
 	// These are checks that are independent of context
 	// that can be verified before saving an orphan block.
 
+	if (fChecked)
+		return true;
+
 	// Size limits
 	if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
 		return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2118,6 +2503,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
 	if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
 		return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+	if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
+		fChecked = true;
 
 	return true;
 }
@@ -2135,7 +2522,7 @@ bool CBlock::AcceptBlock()
 		return error("AcceptBlock() : block already in mapBlockIndex");
 
 	// Get prev block index
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
 	if (mi == mapBlockIndex.end())
 		return DoS(10, error("AcceptBlock() : prev block not found"));
 	CBlockIndex* pindexPrev = (*mi).second;
@@ -2217,6 +2604,7 @@ bool CBlock::AcceptBlock()
 		BOOST_FOREACH(CNode* pnode, vNodes)
 			if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
 				pnode->PushInventory(CInv(MSG_BLOCK, hash));
+		WakeMessageHandler();
 	}
 
 	return true;
@@ -2224,13 +2612,17 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-	CBigNum bnTarget;
-	bnTarget.SetCompact(nBits);
+	bool fNegative, fOverflow;
+	arith_uint256 bnTarget;
+	bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-	if (bnTarget <= 0)
+	// A target of 2^256 or more gives no trust, as 2^256 / (bnTarget+1) did
+	if (fNegative || fOverflow || bnTarget == 0)
 		return 0;
 
-	return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+	// 2^256 / (bnTarget+1) does not fit in 256 bits, but it equals
+	// ~bnTarget / (bnTarget+1) + 1
+	return (~bnTarget / (bnTarget + 1)) + 1;
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2256,6 +2648,361 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 	pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+// Height and time of a block we have or know the header of
+bool static GetHeaderInfo(const uint256& hash, int& nHeightRet, unsigned int& nTimeRet)
+{
+	map<uint256, CBlockHeaderEntry>::iterator it = mapBlockHeaders.find(hash);
+	if (it != mapBlockHeaders.end())
+	{
+		nHeightRet = it->second.nHeight;
+		nTimeRet = it->second.nTime;
+		return true;
+	}
+	BlockMap::iterator mi = mapBlockIndex.find(hash);
+	if (mi != mapBlockIndex.end())
+	{
+		nHeightRet = mi->second->nHeight;
+		nTimeRet = mi->second->nTime;
+		return true;
+	}
+	return false;
+}
+
+void static SetBestHeader(const uint256& hash, int nHeight)
+{
+	// Re-point the header chain from the new best header back to where it
+	// meets the old one, or the block index
+	uint256 hashWalk = hash;
+	int nWalk = nHeight;
+	while (true)
+	{
+		map<int, uint256>::iterator it = mapHeaderChain.find(nWalk);
+		if (it != mapHeaderChain.end() && it->second == hashWalk)
+			break;
+		map<uint256, CBlockHeaderEntry>::iterator mi = mapBlockHeaders.find(hashWalk);
+		if (mi == mapBlockHeaders.end())
+		{
+			mapHeaderChain.erase(mapHeaderChain.begin(), mapHeaderChain.upper_bound(nWalk));
+			break;
+		}
+		mapHeaderChain[nWalk--] = hashWalk;
+		hashWalk = mi->second.hashPrev;
+	}
+	mapHeaderChain.erase(mapHeaderChain.upper_bound(nHeight), mapHeaderChain.end());
+	hashBestHeader = hash;
+	nBestHeaderHeight = nHeight;
+	nHeaderChainVersion++;
+}
+
+// After headers were removed, fall back to the highest one left if the best
+// header went with them
+void static CheckBestHeader()
+{
+	if (hashBestHeader == 0 || mapBlockHeaders.count(hashBestHeader) || mapBlockIndex.count(hashBestHeader))
+		return;
+	if (mapBlockHeadersByHeight.empty())
+	{
+		mapHeaderChain.clear();
+		hashBestHeader = 0;
+		nBestHeaderHeight = -1;
+		nHeaderChainVersion++;
+		return;
+	}
+	multimap<int, uint256>::reverse_iterator it = mapBlockHeadersByHeight.rbegin();
+	SetBestHeader(it->second, it->first);
+}
+
+void static EraseHeaderLink(multimap<uint256, uint256>& mapLinks, const uint256& key, const uint256& hash)
+{
+	for (multimap<uint256, uint256>::iterator it = mapLinks.lower_bound(key); it != mapLinks.upper_bound(key); ++it)
+	{
+		if (it->second == hash)
+		{
+			mapLinks.erase(it);
+			return;
+		}
+	}
+}
+
+// Drop a single header, leaving the headers built on it in place
+void static ForgetBlockHeader(const uint256& hash)
+{
+	map<uint256, CBlockHeaderEntry>::iterator mi = mapBlockHeaders.find(hash);
+	if (mi == mapBlockHeaders.end())
+		return;
+	const CBlockHeaderEntry& entry = mi->second;
+	for (multimap<int, uint256>::iterator it = mapBlockHeadersByHeight.lower_bound(entry.nHeight); it != mapBlockHeadersByHeight.upper_bound(entry.nHeight); ++it)
+	{
+		if (it->second == hash)
+		{
+			mapBlockHeadersByHeight.erase(it);
+			break;
+		}
+	}
+	EraseHeaderLink(mapBlockHeadersByPrev, entry.hashPrev, hash);
+	entry.pfrom->setBlockHeaders.erase(hash);
+	mapBlockHeaders.erase(mi);
+}
+
+// Drop a header and every header built on it
+void static RemoveBlockHeader(const uint256& hash)
+{
+	vector<uint256> vRemove(1, hash);
+	for (unsigned int i = 0; i < vRemove.size(); i++)
+	{
+		const uint256 hashRemove = vRemove[i];
+		for (multimap<uint256, uint256>::iterator it = mapBlockHeadersByPrev.lower_bound(hashRemove); it != mapBlockHeadersByPrev.upper_bound(hashRemove); ++it)
+			vRemove.push_back(it->second);
+		ForgetBlockHeader(hashRemove);
+	}
+	nHeaderChainVersion++;
+	CheckBestHeader();
+}
+
+// Everything a peer was the first to send goes when it misbehaves or leaves
+void static DropBlockHeaders(CNode* pnode)
+{
+	while (!pnode->setBlockHeaders.empty())
+		RemoveBlockHeader(*pnode->setBlockHeaders.begin());
+}
+
+// The block of a header failed the consensus rules in its context: remember
+// it so the branch is not accepted again, and drop it with everything built
+// on it. If the peer that sent the header also sent the block, its other
+// headers go too. Only for bodies that passed CheckBlock, as the block hash
+// commits to neither the block signature nor the exact transaction list.
+void static InvalidBlockHeader(const uint256& hash, CNode* pfrom)
+{
+	map<uint256, CBlockHeaderEntry>::iterator mi = mapBlockHeaders.find(hash);
+	if (mi == mapBlockHeaders.end())
+		return;
+	CNode* pnodeHeader = mi->second.pfrom;
+	setFailedHeaders.insert(hash);
+	RemoveBlockHeader(hash);
+	if (pfrom && pfrom == pnodeHeader)
+		DropBlockHeaders(pfrom);
+}
+
+// Headers at or below the active tip are of no more use to the download,
+// whether they are on its chain or on a side branch
+void static PruneBlockHeaders()
+{
+	mapHeaderChain.erase(mapHeaderChain.begin(), mapHeaderChain.upper_bound(nBestHeight));
+	while (!mapBlockHeadersByHeight.empty() && mapBlockHeadersByHeight.begin()->first <= nBestHeight)
+		RemoveBlockHeader(mapBlockHeadersByHeight.begin()->second);
+}
+
+bool static HeaderLimitReached(CNode* pnode)
+{
+	return pnode->setBlockHeaders.size() >= MAX_HEADERS_PER_PEER || mapBlockHeaders.size() >= MAX_BLOCK_HEADERS;
+}
+
+// The peer has the block, so it also has every block before it
+void static UpdateBestKnownHeader(CNode* pnode, const uint256& hash)
+{
+	int nHeight;
+	unsigned int nTime;
+	if (GetHeaderInfo(hash, nHeight, nTime) && nHeight > pnode->nBestKnownHeaderHeight)
+	{
+		pnode->hashBestKnownHeader = hash;
+		pnode->nBestKnownHeaderHeight = nHeight;
+	}
+}
+
+// Height up to which the blocks of the header chain are known to be on the
+// peer's chain: where its best known header meets the header chain, or -1
+int static GetPeerHeaderChainHeight(CNode* pnode)
+{
+	if (pnode->hashCommonHeaderFrom == pnode->hashBestKnownHeader && pnode->nCommonHeaderVersion == nHeaderChainVersion)
+		return pnode->nCommonHeaderHeight;
+
+	int nHeight = -1;
+	uint256 hashWalk = pnode->hashBestKnownHeader;
+	map<uint256, CBlockHeaderEntry>::iterator mi;
+	while ((mi = mapBlockHeaders.find(hashWalk)) != mapBlockHeaders.end())
+	{
+		map<int, uint256>::iterator it = mapHeaderChain.find(mi->second.nHeight);
+		if (it != mapHeaderChain.end() && it->second == hashWalk)
+		{
+			nHeight = mi->second.nHeight;
+			break;
+		}
+		hashWalk = mi->second.hashPrev;
+	}
+
+	pnode->hashCommonHeaderFrom = pnode->hashBestKnownHeader;
+	pnode->nCommonHeaderVersion = nHeaderChainVersion;
+	pnode->nCommonHeaderHeight = nHeight;
+	return nHeight;
+}
+
+// Context checks of a header received ahead of its block. The stake kernel
+// needs the coinstake, so for proof-of-stake headers only the timestamp
+// granularity the coinstake imposes can be checked here. As they cost nothing
+// to make, such headers may extend the header chain but never replace it
+// with another branch; that is left to blocks.
+bool static AcceptBlockHeader(const CBlock& header, CNode* pfrom)
+{
+	AssertLockHeld(cs_main);
+
+	uint256 hash = header.GetHash();
+	if (mapBlockIndex.count(hash) || mapBlockHeaders.count(hash))
+		return true;
+
+	// Built on a block that failed, ignore the branch
+	if (setFailedHeaders.count(hash) || setFailedHeaders.count(header.hashPrevBlock))
+	{
+		setFailedHeaders.insert(hash);
+		return true;
+	}
+
+	int nHeightPrev;
+	unsigned int nTimePrev;
+	if (!GetHeaderInfo(header.hashPrevBlock, nHeightPrev, nTimePrev))
+	{
+		pfrom->Misbehaving(20);
+		return error("AcceptBlockHeader() : prev block not found for %s", hash.ToString());
+	}
+	int nHeight = nHeightPrev + 1;
+
+	if (header.nVersion < 7)
+	{
+		pfrom->Misbehaving(100);
+		return error("AcceptBlockHeader() : reject too old nVersion = %d", header.nVersion);
+	}
+
+	if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+		return error("AcceptBlockHeader() : block timestamp too far in the future");
+	if (header.nTime <= nTimePrev)
+		return error("AcceptBlockHeader() : block's timestamp is too early");
+
+	bool fStakeTime = (header.nTime & STAKE_TIMESTAMP_MASK) == 0;
+	bool fProofOfWork = !fStakeTime && nHeight <= Params().LastPOWBlock() && CheckProofOfWork(header.GetPoWHash(), header.nBits);
+	if (!fStakeTime && !fProofOfWork)
+	{
+		pfrom->Misbehaving(50);
+		return error("AcceptBlockHeader() : neither proof-of-work nor proof-of-stake at height %d", nHeight);
+	}
+
+	if (!Checkpoints::CheckHardened(nHeight, hash))
+	{
+		pfrom->Misbehaving(100);
+		return error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+	}
+
+	CBlockHeaderEntry& entry = mapBlockHeaders[hash];
+	entry.hashPrev = header.hashPrevBlock;
+	entry.nHeight = nHeight;
+	entry.nTime = header.nTime;
+	entry.pfrom = pfrom;
+	mapBlockHeadersByHeight.insert(make_pair(nHeight, hash));
+	mapBlockHeadersByPrev.insert(make_pair(header.hashPrevBlock, hash));
+	pfrom->setBlockHeaders.insert(hash);
+
+	// Unchecked stake headers only continue the header chain, or start a new
+	// one from a block we have when it has none above the tip
+	bool fExtends = header.hashPrevBlock == hashBestHeader ||
+		(nBestHeaderHeight <= nBestHeight && mapBlockIndex.count(header.hashPrevBlock));
+	if (nHeight > nBestHeaderHeight && (fProofOfWork || fExtends))
+		SetBestHeader(hash, nHeight);
+	return true;
+}
+
+void static PushGetHeaders(CNode* pnode)
+{
+	// Locator of the active chain, led by the header chain above it. It starts
+	// below the best header, so that a peer having that header sends it back
+	// and shows how far it is along the header chain.
+	std::vector<uint256> vHeaderHashes;
+	int nStep = 1;
+	for (int nHeight = nBestHeaderHeight - 1; nHeight > nBestHeight; nHeight -= nStep)
+	{
+		map<int, uint256>::iterator it = mapHeaderChain.find(nHeight);
+		if (it == mapHeaderChain.end())
+			break;
+		vHeaderHashes.push_back(it->second);
+		if (vHeaderHashes.size() > 10)
+			nStep *= 2;
+	}
+	CBlockLocator locator(pindexBest);
+	locator.Prepend(vHeaderHashes);
+	pnode->PushMessage("getheaders", locator, uint256(0));
+	pnode->nLastGetHeaders = GetTime();
+}
+
+// Requests of this peer are handed back to be fetched from someone else
+void static ReleaseBlocksInFlight(CNode* pnode)
+{
+	for (map<uint256, int64_t>::iterator it = pnode->mapBlocksInFlight.begin(); it != pnode->mapBlocksInFlight.end(); ++it)
+		mapBlocksInFlight.erase(it->first);
+	pnode->mapBlocksInFlight.clear();
+}
+
+void static FinalizeNode(CNode* pnode)
+{
+	LOCK(cs_main);
+	ReleaseBlocksInFlight(pnode);
+	DropBlockHeaders(pnode);
+}
+
+// Headers-first block download: drop a peer that sits on a block it is known
+// to have for too long, then fill its request window with the next blocks of
+// the header chain that it has and nobody is fetching yet
+void static RequestHeaderChainBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+	PruneBlockHeaders();
+	int nPeerHeight = GetPeerHeaderChainHeight(pto);
+
+	int64_t nNow = GetTime();
+	vector<uint256> vExpired;
+	for (map<uint256, int64_t>::iterator it = pto->mapBlocksInFlight.begin(); it != pto->mapBlocksInFlight.end(); ++it)
+	{
+		if (nNow - it->second <= BLOCK_STALLING_TIMEOUT)
+			continue;
+		map<uint256, CBlockHeaderEntry>::iterator mi = mapBlockHeaders.find(it->first);
+		map<int, uint256>::iterator mc = mi == mapBlockHeaders.end() ? mapHeaderChain.end() : mapHeaderChain.find(mi->second.nHeight);
+		if (mc != mapHeaderChain.end() && mc->first <= nPeerHeight && mc->second == it->first)
+		{
+			LogPrintf("peer %s stalled on block %s, disconnecting\n", pto->addrName, it->first.ToString());
+			ReleaseBlocksInFlight(pto);
+			pto->fDisconnect = true;
+			return;
+		}
+		// No longer on the header chain as far as this peer is known to
+		// follow it; let someone else fetch it
+		vExpired.push_back(it->first);
+	}
+	BOOST_FOREACH(const uint256& hash, vExpired)
+	{
+		pto->mapBlocksInFlight.erase(hash);
+		mapBlocksInFlight.erase(hash);
+	}
+
+	if (!fHeadersFirst || pto->fDisconnect || pto->fClient || pto->fOneShot || !pto->fSuccessfullyConnected ||
+		(pto->nVersion >= NOBLKS_VERSION_START && pto->nVersion < NOBLKS_VERSION_END))
+		return;
+
+	// Ask the peer for headers when it is not known to have the blocks about
+	// to be downloaded: the reply shows how far it follows the header chain,
+	// or extends it, also after header sync stopped at the limits
+	int nWanted = std::min(nBestHeight + BLOCK_DOWNLOAD_WINDOW, std::max(nBestHeaderHeight, pto->nStartingHeight));
+	if (nPeerHeight < nWanted && nWanted > nBestHeight && !HeaderLimitReached(pto) &&
+		nNow - pto->nLastGetHeaders > HEADERS_REFRESH_INTERVAL)
+		PushGetHeaders(pto);
+
+	int nWindowEnd = std::min(nBestHeight + BLOCK_DOWNLOAD_WINDOW, nPeerHeight);
+	for (map<int, uint256>::iterator it = mapHeaderChain.begin();
+		 it != mapHeaderChain.end() && it->first <= nWindowEnd && pto->mapBlocksInFlight.size() < MAX_BLOCKS_IN_FLIGHT; ++it)
+	{
+		const uint256& hash = it->second;
+		if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+			continue;
+		vGetData.push_back(CInv(MSG_BLOCK, hash));
+		mapBlocksInFlight[hash] = pto;
+		pto->mapBlocksInFlight[hash] = nNow;
+	}
+}
+
 bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
 {
 	if (pblock->IsProofOfWork()) {
@@ -2348,8 +3095,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 			if (pblock->IsProofOfStake())
 				setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-			// Ask this guy to fill in what we're missing
-			PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+			// Ask this guy to fill in what we're missing, unless the parents
+			// are known from the header chain and being downloaded already
+			if (!mapBlockHeaders.count(hash))
+				PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
 			// ppcoin: getblocks may not obtain the ancestor block rejected
 			// earlier by duplicate-stake check so we ask for it again directly
 			if (!IsInitialBlockDownload())
@@ -2360,7 +3109,13 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
 	// Store to disk
 	if (!pblock->AcceptBlock())
+	{
+		// Failures without a DoS score are not the block's fault, such as
+		// running out of disk space
+		if (pblock->nDoS)
+			InvalidBlockHeader(hash, pfrom);
 		return error("ProcessBlock() : AcceptBlock FAILED");
+	}
 
 	// Recursively process any orphan blocks that depended on this one
 	vector<uint256> vWorkQueue;
@@ -2380,6 +3135,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 			block.BuildMerkleTree();
 			if (block.AcceptBlock())
 				vWorkQueue.push_back(mi->second->hashBlock);
+			else if (block.nDoS)
+				InvalidBlockHeader(mi->second->hashBlock, NULL);
 			mapOrphanBlocks.erase(mi->second->hashBlock);
 			setStakeSeenOrphan.erase(block.GetProofOfStake());
 			nOrphanBlocksSize -= mi->second->vchBlock.size();
@@ -2493,7 +3250,19 @@ bool CBlock::CheckBlockSignature() const
 
 bool CheckDiskSpace(uint64_t nAdditionalBytes)
 {
-	uint64_t nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+	// Asking the filesystem is a system call on every accepted block, so the
+	// answer is reused for a minute and counted down by what callers said
+	// they were about to write. Getting close to the limit forces a recheck.
+	static CCriticalSection cs_space;
+	static int64_t nLastCheck = 0;
+	static uint64_t nFreeBytesAvailable = 0;
+
+	LOCK(cs_space);
+	if (GetTime() - nLastCheck >= 60 || nFreeBytesAvailable < 2 * nMinDiskSpace + nAdditionalBytes)
+	{
+		nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+		nLastCheck = GetTime();
+	}
 
 	// Check for nMinDiskSpace bytes (currently 50MB)
 	if (nFreeBytesAvailable < nMinDiskSpace + nAdditionalBytes)
@@ -2505,56 +3274,10 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
 		StartShutdown();
 		return false;
 	}
+	nFreeBytesAvailable -= nAdditionalBytes;
 	return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-	string strBlockFn = strprintf("blk%04u.dat", nFile);
-	return GetDataDir() / strBlockFn;
-}
-
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
-{
-	if ((nFile < 1) || (nFile == (unsigned int) -1))
-		return NULL;
-	FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
-	if (!file)
-		return NULL;
-	if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
-	{
-		if (fseek(file, nBlockPos, SEEK_SET) != 0)
-		{
-			fclose(file);
-			return NULL;
-		}
-	}
-	return file;
-}
-
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
-{
-	nFileRet = 0;
-	while (true)
-	{
-		FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-		if (!file)
-			return NULL;
-		if (fseek(file, 0, SEEK_END) != 0)
-			return NULL;
-		// FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-		if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
-		{
-			nFileRet = nCurrentBlockFile;
-			return file;
-		}
-		fclose(file);
-		nCurrentBlockFile++;
-	}
-}
-
 bool LoadBlockIndex(bool fAllowNew)
 {
 	LOCK(cs_main);
@@ -2591,6 +3314,9 @@ bool LoadBlockIndex(bool fAllowNew)
 			return error("LoadBlockIndex() : genesis block not accepted");
 	}
 
+	if (pindexBest)
+		stakeWeightStats.SetTip(pindexBest);
+
 	return true;
 }
 
@@ -2601,7 +3327,7 @@ void PrintBlockTree()
 	AssertLockHeld(cs_main);
 	// pre-compute tree structure
 	map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-	for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+	for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
 	{
 		CBlockIndex* pindex = (*mi).second;
 		mapNext[pindex->pprev].push_back(pindex);
@@ -2669,66 +3395,235 @@ void PrintBlockTree()
 	}
 }
 
+bool CExternalBlockReader::Fill(unsigned int nNeed)
+{
+	if (nEnd - nBegin >= nNeed)
+		return true;
+	if (nBegin > 0)
+	{
+		memmove(&vBuf[0], &vBuf[0] + nBegin, nEnd - nBegin);
+		nEnd -= nBegin;
+		nBegin = 0;
+	}
+	if (vBuf.size() < nNeed)
+		vBuf.resize(nNeed);
+	while (nEnd < nNeed && !fEof)
+	{
+		size_t nRead = fread(&vBuf[nEnd], 1, vBuf.size() - nEnd, file);
+		if (nRead == 0)
+			fEof = true;
+		nEnd += nRead;
+	}
+	return nEnd >= nNeed;
+}
+
+bool CExternalBlockReader::Next(std::vector<char>& vchBlock)
+{
+	const unsigned char* pchMessageStart = Params().MessageStart();
+	while (Fill(MESSAGE_START_SIZE + sizeof(unsigned int)))
+	{
+		boost::this_thread::interruption_point();
+		char* pchBegin = &vBuf[nBegin];
+		char* pchFind = (char*)memchr(pchBegin, pchMessageStart[0], nEnd - nBegin - MESSAGE_START_SIZE + 1);
+		if (!pchFind)
+		{
+			nBegin = nEnd - MESSAGE_START_SIZE + 1;
+			continue;
+		}
+		nBegin += pchFind - pchBegin;
+		if (memcmp(pchFind, pchMessageStart, MESSAGE_START_SIZE) != 0)
+		{
+			nBegin++;
+			continue;
+		}
+		nBegin += MESSAGE_START_SIZE;
+
+		// A marker found near the end of the window may be all there is
+		// buffered of this block
+		unsigned int nSize;
+		if (!Fill(sizeof(nSize)))
+			return false;
+		memcpy(&nSize, &vBuf[nBegin], sizeof(nSize));
+		if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+			continue;
+		if (!Fill(sizeof(nSize) + nSize))
+			return false;
+		nBegin += sizeof(nSize);
+		vchBlock.assign(&vBuf[nBegin], &vBuf[nBegin] + nSize);
+		nBegin += nSize;
+		return true;
+	}
+	return false;
+}
+
+/** Blocks read from an external file, in file order */
+struct CImportBatch
+{
+	std::vector<std::vector<char> > vvchBlock;
+	std::vector<CBlock> vblock;
+};
+
+/** Import stage that runs off the connecting thread: deserializes a batch,
+ *  hashes the headers and runs the context-free checks. A block that fails
+ *  to deserialize is left null; CheckBlock results are remembered by the
+ *  block and failures are reported again by ProcessBlock, so this always
+ *  succeeds. */
+class CImportBlockCheck
+{
+private:
+	CImportBatch* pbatch;
+
+public:
+	CImportBlockCheck() : pbatch(NULL) {}
+	CImportBlockCheck(CImportBatch* pbatchIn) : pbatch(pbatchIn) {}
+
+	bool operator()()
+	{
+		pbatch->vblock.resize(pbatch->vvchBlock.size());
+		for (unsigned int i = 0; i < pbatch->vvchBlock.size(); i++)
+		{
+			try {
+				CDataStream ssBlock(pbatch->vvchBlock[i], SER_DISK, CLIENT_VERSION);
+				ssBlock >> pbatch->vblock[i];
+			}
+			catch (std::exception &e) {
+				pbatch->vblock[i].SetNull();
+			}
+			std::vector<char>().swap(pbatch->vvchBlock[i]);
+		}
+		PrecomputeBlockHashes(pbatch->vblock);
+		BOOST_FOREACH(const CBlock& block, pbatch->vblock)
+			if (!block.IsNull())
+				block.CheckBlock();
+		return true;
+	}
+
+	void swap(CImportBlockCheck& check)
+	{
+		std::swap(pbatch, check.pbatch);
+	}
+};
+
+/** Last import stage: hands checked blocks to ProcessBlock in file order.
+ *  A block whose parent has not been seen yet is kept in memory until the
+ *  parent is accepted, rather than being dropped as an orphan. */
+class CImportConnector
+{
+private:
+	std::multimap<uint256, CBlock> mapHeld;
+	uint64_t nHeldSize;
+
+public:
+	int nLoaded;
+
+	CImportConnector() : nHeldSize(0), nLoaded(0) {}
+
+	void Connect(CBlock& block)
+	{
+		if (block.IsNull())
+			return;
+
+		LOCK(cs_main);
+		uint256 hash = block.GetHash();
+		if (!mapBlockIndex.count(block.hashPrevBlock) && !mapBlockIndex.count(hash))
+		{
+			// Only out-of-order blocks end up here, so the limit is rarely hit
+			unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+			if (nHeldSize + nSize > 128 * 1024 * 1024)
+			{
+				LogPrintf("LoadExternalBlockFile() : dropping out-of-order block %s\n", hash.ToString());
+				return;
+			}
+			mapHeld.insert(make_pair(block.hashPrevBlock, block));
+			nHeldSize += nSize;
+			return;
+		}
+		if (!ProcessBlock(NULL, &block))
+			return;
+		nLoaded++;
+
+		// Connect the held descendants of the block just accepted
+		std::vector<uint256> vWorkQueue(1, hash);
+		while (!vWorkQueue.empty())
+		{
+			uint256 hashPrev = vWorkQueue.back();
+			vWorkQueue.pop_back();
+			std::multimap<uint256, CBlock>::iterator it = mapHeld.lower_bound(hashPrev);
+			while (it != mapHeld.end() && it->first == hashPrev)
+			{
+				CBlock& blockHeld = it->second;
+				nHeldSize -= ::GetSerializeSize(blockHeld, SER_DISK, CLIENT_VERSION);
+				if (ProcessBlock(NULL, &blockHeld))
+				{
+					nLoaded++;
+					vWorkQueue.push_back(blockHeld.GetHash());
+				}
+				mapHeld.erase(it++);
+			}
+		}
+	}
+
+	unsigned int GetHeldCount() const { return mapHeld.size(); }
+};
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
 	int64_t nStart = GetTimeMillis();
 
-	int nLoaded = 0;
+	// Blocks move through three stages: this thread reads a window of
+	// batches and queues them for the -par threads, which deserialize and
+	// check them while this thread connects the window read before.
+	static const unsigned int nBatchSize = 16;
+	const unsigned int nWindowBatches = 4 * std::max(nScriptCheckThreads, 1);
+
+	CImportConnector connector;
 	{
+		CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+		CExternalBlockReader reader(blkdat);
+		std::vector<CImportBatch> vChecked, vPending;
+		CCheckQueue<CImportBlockCheck> importqueue(1);
+		CCheckQueueThreads<CImportBlockCheck> importThreads(importqueue, nScriptCheckThreads - 1);
 		try {
-			CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-			unsigned int nPos = 0;
-			while (nPos != (unsigned int)-1 && blkdat.good())
+			bool fMore = true;
+			while (fMore || !vChecked.empty())
 			{
 				boost::this_thread::interruption_point();
-				unsigned char pchData[65536];
-				do {
-					fseek(blkdat, nPos, SEEK_SET);
-					int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-					if (nRead <= 8)
-					{
-						nPos = (unsigned int)-1;
-						break;
-					}
-					void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-					if (nFind)
-					{
-						if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-						{
-							nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-							break;
-						}
-						nPos += ((unsigned char*)nFind - pchData) + 1;
-					}
-					else
-						nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-					boost::this_thread::interruption_point();
-				} while(true);
-				if (nPos == (unsigned int)-1)
-					break;
-				fseek(blkdat, nPos, SEEK_SET);
-				unsigned int nSize;
-				blkdat >> nSize;
-				if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+
+				vPending.clear();
+				std::vector<char> vchBlock;
+				while (fMore && vPending.size() < nWindowBatches)
 				{
-					CBlock block;
-					blkdat >> block;
-					LOCK(cs_main);
-					if (ProcessBlock(NULL,&block))
+					vPending.push_back(CImportBatch());
+					CImportBatch& batch = vPending.back();
+					while (batch.vvchBlock.size() < nBatchSize && (fMore = reader.Next(vchBlock)))
 					{
-						nLoaded++;
-						nPos += 4 + nSize;
+						batch.vvchBlock.push_back(std::vector<char>());
+						batch.vvchBlock.back().swap(vchBlock);
 					}
 				}
+				std::vector<CImportBlockCheck> vChecks;
+				BOOST_FOREACH(CImportBatch& batch, vPending)
+					vChecks.push_back(CImportBlockCheck(&batch));
+				importqueue.Add(vChecks);
+
+				BOOST_FOREACH(CImportBatch& batch, vChecked)
+					BOOST_FOREACH(CBlock& block, batch.vblock)
+						connector.Connect(block);
+
+				importqueue.Wait();
+				vChecked.swap(vPending);
 			}
 		}
 		catch (std::exception &e) {
-			LogPrintf("%s() : Deserialize or I/O error caught during load\n",
+			LogPrintf("%s() : I/O error caught during load\n",
 				   __PRETTY_FUNCTION__);
+			importqueue.Wait();
 		}
 	}
-	LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-	return nLoaded > 0;
+	if (connector.GetHeldCount() > 0)
+		LogPrintf("LoadExternalBlockFile() : %u blocks without a known parent\n", connector.GetHeldCount());
+	LogPrintf("Loaded %i blocks from external file in %dms\n", connector.nLoaded, GetTimeMillis() - nStart);
+	return connector.nLoaded > 0;
 }
 
 struct CImportingNow
@@ -2870,8 +3765,6 @@ void static ProcessGetData(CNode* pfrom)
 
 	vector<CInv> vNotFound;
 
-	LOCK(cs_main);
-
 	while (it != pfrom->vRecvGetData.end()) {
 		// Don't bother if send buffer is too full to respond anyway
 		if (pfrom->nSendSize >= SendBufferSize())
@@ -2884,20 +3777,47 @@ void static ProcessGetData(CNode* pfrom)
 
 			if (inv.type == MSG_BLOCK)
 			{
-				// Send block from disk
-				map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-				if (mi != mapBlockIndex.end())
+				// Only the lookup needs cs_main. Block index entries are never
+				// freed and their disk position does not change, so the block
+				// is read without holding up the other peers.
+				CBlockIndex* pindex = NULL;
+				bool fLowS = false;
+				uint256 hashBest;
 				{
-					CBlock block;
-					block.ReadFromDisk((*mi).second);
+					LOCK(cs_main);
+					BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+					if (mi != mapBlockIndex.end())
+					{
+						pindex = (*mi).second;
+						fLowS = pindex->nFlags & CBlockIndex::BLOCK_LOW_S_SIG;
+						hashBest = hashBestChain;
+					}
+				}
+				if (pindex)
+				{
+					// Send block from disk
+					CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+					if (!fLowS || !ReadRawBlockFromDisk(ssBlock, pindex))
+					{
+						CBlock block;
+						bool fRead = block.ReadFromDisk(pindex);
 
-					// previous versions could accept sigs with high s
-					if (!IsCanonicalBlockSignature(&block, true)) {
-						bool ret = EnsureLowS(block.vchBlockSig);
-						assert(ret);
+						// previous versions could accept sigs with high s
+						if (!IsCanonicalBlockSignature(&block, true)) {
+							bool ret = EnsureLowS(block.vchBlockSig);
+							assert(ret);
+						}
+						else if (fRead) {
+							// stored low-S after all, serve it raw from now on
+							LOCK(cs_main);
+							pindex->nFlags |= CBlockIndex::BLOCK_LOW_S_SIG;
+						}
+
+						ssBlock.clear();
+						ssBlock << block;
 					}
 
-					pfrom->PushMessage("block", block);
+					pfrom->PushMessage("block", ssBlock);
 
 					// Trigger them to send a getblocks request for the next batch of inventory
 					if (inv.hash == pfrom->hashContinue)
@@ -2906,7 +3826,7 @@ void static ProcessGetData(CNode* pfrom)
 						// and we want it right after the last block so they don't
 						// wait for other stuff first.
 						vector<CInv> vInv;
-						vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+						vInv.push_back(CInv(MSG_BLOCK, hashBest));
 						pfrom->PushMessage("inv", vInv);
 						pfrom->hashContinue = 0;
 					}
@@ -2914,29 +3834,20 @@ void static ProcessGetData(CNode* pfrom)
 			}
 			else if (inv.IsKnownType())
 			{
-				// Send stream from relay memory
-				bool pushed = false;
+				// Send from relay memory, or from the memory pool
+				CTransactionRef ptx;
 				{
 					LOCK(cs_mapRelay);
-					map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-					if (mi != mapRelay.end()) {
-						pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-						pushed = true;
-					}
+					map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
+					if (mi != mapRelay.end())
+						ptx = (*mi).second;
 				}
-				if (!pushed && inv.type == MSG_TX) {
-					CTransaction tx;
-					if (mempool.lookup(inv.hash, tx)) {
-						CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-						ss.reserve(1000);
-						ss << tx;
-						pfrom->PushMessage("tx", ss);
-						pushed = true;
-					}
-				}
-				if (!pushed) {
+				if (!ptx && inv.type == MSG_TX)
+					ptx = mempool.get(inv.hash);
+				if (ptx)
+					pfrom->PushMessage("tx", *ptx);
+				else
 					vNotFound.push_back(inv);
-				}
 			}
 
 			// Track requests for our stuff.
@@ -2961,6 +3872,10 @@ void static ProcessGetData(CNode* pfrom)
 	}
 }
 
+// Messages of different peers are handled concurrently by the message handler
+// threads. Handlers take cs_main for chain state and for the address and alert
+// relay state they share with other peers; getdata, getaddr, mempool, ping and
+// pong only need the locks of the structures they read.
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
 	RandAddSeedPerfmon();
@@ -3010,6 +3925,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 			return true;
 		}
 
+		// Address and alert relay state is shared with other peers' handlers
+		LOCK(cs_main);
+
 		pfrom->addrLocal = addrMe;
 		if (pfrom->fInbound && addrMe.IsRoutable())
 		{
@@ -3102,6 +4020,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 			return error("message addr size() = %u", vAddr.size());
 		}
 
+		// setAddrKnown and vAddrToSend of the peers relayed to are shared
+		// with their own handlers
+		LOCK(cs_main);
+
 		// Store the new addresses
 		vector<CAddress> vAddrOk;
 		int64_t nNow = GetAdjustedTime();
@@ -3185,11 +4107,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 			bool fAlreadyHave = AlreadyHave(txdb, inv);
 			LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
+			if (inv.type == MSG_BLOCK)
+				UpdateBestKnownHeader(pfrom, inv.hash);
 
 			if (!fAlreadyHave) {
-				if (!fImporting)
+				if (!fImporting && !(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
 					pfrom->AskFor(inv);
-			} else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+			} else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapBlockHeaders.count(inv.hash)) {
 				PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
 			} else if (nInv == nLastBlock) {
 				// In case we are on a very long side-chain, it is possible that we already have
@@ -3274,7 +4198,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 		if (locator.IsNull())
 		{
 			// If locator is null, return the hashStop block
-			map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+			BlockMap::iterator mi = mapBlockIndex.find(hashStop);
 			if (mi == mapBlockIndex.end())
 				return true;
 			pindex = (*mi).second;
@@ -3300,6 +4224,44 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 	}
 
 
+	else if (strCommand == "headers" && !fImporting && !fReindex)
+	{
+		vector<CBlock> vHeaders;
+		vRecv >> vHeaders;
+		if (vHeaders.size() > 2000)
+		{
+			pfrom->Misbehaving(20);
+			return error("message headers size() = %u", vHeaders.size());
+		}
+
+		LOCK(cs_main);
+
+		unsigned int nNew = 0;
+		BOOST_FOREACH(const CBlock& header, vHeaders)
+		{
+			if (HeaderLimitReached(pfrom))
+				break;
+			uint256 hash = header.GetHash();
+			bool fNew = !mapBlockHeaders.count(hash) && !mapBlockIndex.count(hash);
+			if (!AcceptBlockHeader(header, pfrom))
+			{
+				DropBlockHeaders(pfrom);
+				return error("invalid header received from %s", pfrom->addrName);
+			}
+			if (fNew && mapBlockHeaders.count(hash))
+				nNew++;
+			UpdateBestKnownHeader(pfrom, hash);
+		}
+
+		// A full batch of new headers means the peer has more; blocks are
+		// requested from all peers by SendMessages, which also resumes header
+		// sync stopped at the limits once blocks made room
+		if (vHeaders.size() == 2000 && nNew > 0 && !HeaderLimitReached(pfrom))
+			PushGetHeaders(pfrom);
+		LogPrint("net", "received %u headers, best header height %d\n", vHeaders.size(), nBestHeaderHeight);
+	}
+
+
 	else if (strCommand == "tx")
 	{
 		vector<uint256> vWorkQueue;
@@ -3381,9 +4343,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 		LOCK(cs_main);
 
+		// Delivered by the peer it was requested from, so no longer in flight.
+		// Anyone else may be sending a mutated copy of it.
+		map<uint256, CNode*>::iterator it = mapBlocksInFlight.find(hashBlock);
+		if (it != mapBlocksInFlight.end() && it->second == pfrom)
+		{
+			it->second->mapBlocksInFlight.erase(hashBlock);
+			mapBlocksInFlight.erase(it);
+		}
+
+		UpdateBestKnownHeader(pfrom, hashBlock);
 		if (ProcessBlock(pfrom, &block))
 			mapAlreadyAskedFor.erase(inv);
-		if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+		if (block.nDoS)
+		{
+			pfrom->Misbehaving(block.nDoS);
+			DropBlockHeaders(pfrom);
+		}
 	}
 
 
@@ -3396,8 +4372,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 	{
 		// Don't return addresses older than nCutOff timestamp
 		int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-		pfrom->vAddrToSend.clear();
 		vector<CAddress> vAddr = addrman.GetAddr();
+
+		LOCK(cs_main);
+		pfrom->vAddrToSend.clear();
 		BOOST_FOREACH(const CAddress &addr, vAddr)
 			if(addr.nTime > nCutOff)
 				pfrom->PushAddress(addr);
@@ -3406,8 +4384,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 	else if (strCommand == "mempool")
 	{
-		LOCK(cs_main);
-
 		std::vector<uint256> vtxid;
 		mempool.queryHashes(vtxid);
 		vector<CInv> vInv;
@@ -3506,6 +4482,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 		CAlert alert;
 		vRecv >> alert;
 
+		LOCK(cs_main);
+
 		uint256 alertHash = alert.GetHash();
 		if (pfrom->setKnown.count(alertHash) == 0)
 		{
@@ -3708,7 +4686,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		// Start block sync
 		if (pto->fStartSync && !fImporting && !fReindex) {
 			pto->fStartSync = false;
-			PushGetBlocks(pto, pindexBest, uint256(0));
+			if (fHeadersFirst)
+				PushGetHeaders(pto);
+			else
+				PushGetBlocks(pto, pindexBest, uint256(0));
 		}
 
 		// Resend wallet transactions that haven't gotten in a block yet
@@ -3817,6 +4798,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		// Message: getdata
 		//
 		vector<CInv> vGetData;
+		if (!fImporting && !fReindex)
+			RequestHeaderChainBlocks(pto, vGetData);
 		int64_t nNow = GetTime() * 1000000;
 		CTxDB txdb("r");
 		while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
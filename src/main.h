@@ -7,12 +7,17 @@
 
 #include "core.h"
 #include "bignum.h"
+#include "blockfile.h"
 #include "sync.h"
 #include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
+#include "hash.h"
 
+#include <boost/unordered_map.hpp>
+
+#include <deque>
 #include <limits>
 #include <list>
 
@@ -22,6 +27,7 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CScriptCheck;
 class CWallet;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
@@ -38,8 +44,23 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of blocks covered by the rolling stake weight statistics */
+static const int STAKE_WEIGHT_WINDOW = 72;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
+/** Blocks requested from one peer at a time during headers-first sync */
+static const unsigned int MAX_BLOCKS_IN_FLIGHT = 16;
+/** How far past the active tip headers-first sync downloads blocks */
+static const int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Seconds a peer has to deliver a requested block before it is dropped */
+static const int64_t BLOCK_STALLING_TIMEOUT = 120;
+/** Headers kept ahead of their blocks, in total and first received from one peer */
+static const unsigned int MAX_BLOCK_HEADERS = 64000;
+static const unsigned int MAX_HEADERS_PER_PEER = 16000;
+/** Seconds between getheaders to a peer that are not the reply to a full batch */
+static const int64_t HEADERS_REFRESH_INTERVAL = 30;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -59,10 +80,14 @@ inline unsigned int GetTargetSpacing(int nHeight) {
     return 180;
 }
 
+struct COrphanBlock;
+typedef boost::unordered_map<uint256, CBlockIndex*, CUint256Hasher> BlockMap;
+typedef boost::unordered_map<uint256, COrphanBlock*, CUint256Hasher> OrphanBlockMap;
+
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -80,12 +105,13 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
-struct COrphanBlock;
-extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
+extern OrphanBlockMap mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
 
 // Settings
 extern bool fUseFastIndex;
+extern bool fHeadersFirst;
 extern unsigned int nDerivationMethodIndex;
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -116,14 +142,21 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Hash the headers of many legacy blocks at once (multi-lane scrypt) into their hash memo */
+void PrecomputeBlockHashes(std::vector<CBlock>& vblock);
+/** Read and check the blocks of several index entries, hashing their headers together */
+bool ReadBlocksFromDisk(const std::vector<CBlockIndex*>& vpindex, std::vector<CBlock>& vblock);
+/** Read the serialized bytes of a stored block without parsing them */
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, unsigned int nFile, unsigned int nBlockPos);
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -304,32 +337,7 @@ public:
      */
     int64_t GetValueIn(const MapPrevTx& mapInputs) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
-    {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
-        return true;
-    }
+    bool ReadFromDisk(CDiskTxPos pos);
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -380,7 +388,7 @@ public:
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -391,18 +399,48 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are pushed onto it instead of being performed inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
                        const CBlockIndex* pindexBlock, uint64_t &nBurnCoins, bool fBlock,
-                       bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL) const;
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** A transaction that is no longer modified, held through CTransactionRef so
+ * that the memory pool, the relay cache, getdata and the miner share one copy
+ * instead of each keeping its own. The hash and serialized size are computed
+ * once, when it is made.
+ */
+class CSharedTransaction : public CTransaction
+{
+private:
+    uint256 hash;
+    unsigned int nTxSize;
+
+public:
+    explicit CSharedTransaction(const CTransaction& tx)
+        : CTransaction(tx), hash(tx.GetHash()), nTxSize(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION))
+    {
+    }
+
+    // Hides CTransaction::GetHash(); through a CTransaction reference the
+    // hash is computed again as usual
+    const uint256& GetHash() const { return hash; }
+    unsigned int GetTxSize() const { return nTxSize; }
+};
+
+inline CTransactionRef MakeTransactionRef(const CTransaction& tx)
+{
+    return CTransactionRef(new CSharedTransaction(tx));
+}
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -447,6 +485,35 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
 
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
@@ -562,6 +629,75 @@ public:
 
 
 
+/** Memory cache of transactions whose outputs can still be spent, so that
+ * fetching inputs does not have to go back to the block files. Entries are
+ * keyed by transaction hash and only served for the disk position the
+ * caller's CTxIndex points at; spent flags stay in the txdb. The least
+ * recently used entries are dropped once the cache exceeds -dbcache.
+ */
+class CCoinsCache
+{
+private:
+    struct CEntry
+    {
+        CTransaction tx;
+        CDiskTxPos pos;
+        unsigned int nBlockTime; // 0 until known
+        unsigned int nSize;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CEntry> mapEntries;
+    std::list<uint256> listLRU; // most recently used first
+    size_t nSize;
+    size_t nMaxSize;
+
+    void Trim();
+
+public:
+    CCoinsCache() : nSize(0), nMaxSize(25 << 20) {}
+
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    /** Remember a transaction stored at pos (nBlockTime may be 0 if unknown) */
+    void Add(const uint256& hash, const CTransaction& tx, const CDiskTxPos& pos, unsigned int nBlockTime = 0);
+    /** Read the transaction stored at pos, from memory if possible */
+    bool ReadTx(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx);
+    /** Time of the block holding the transaction stored at pos */
+    bool ReadBlockTime(const uint256& hash, const CDiskTxPos& pos, unsigned int& nBlockTime);
+};
+
+extern CCoinsCache coinsCache;
+
+/** Stake weight spent by the coinstakes of the last STAKE_WEIGHT_WINDOW
+ * blocks of the best chain. The window follows the tip as blocks are
+ * connected and disconnected, so that reading the average is constant time.
+ */
+class CStakeWeightStats
+{
+private:
+    CCriticalSection cs;
+    std::deque<std::pair<CBlockIndex*, uint64_t> > vWindow; // oldest first
+    uint64_t nWeightSpent;
+    int nStakes;
+
+    void Add(uint64_t nWeight);
+    void Remove(uint64_t nWeight);
+
+public:
+    CStakeWeightStats() : nWeightSpent(0), nStakes(0) {}
+
+    /** Move the window to end at pindexNew; cs_main must be held */
+    void SetTip(CBlockIndex* pindexNew);
+    /** Average spent weight per coinstake in the window, 0 without coinstakes */
+    uint64_t GetAverage(int* pnStakes = NULL);
+};
+
+extern CStakeWeightStats stakeWeightStats;
+
+
+
 
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -595,6 +731,16 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: the last computed hash and the header it belongs to, so
+    // each header is hashed (scrypt for legacy versions) only once
+    mutable bool fHashCached;
+    mutable unsigned char vchHashedHeader[80];
+    mutable uint256 hashCached;
+
+    // memory only: a full CheckBlock() already passed, so that blocks
+    // checked ahead of time on another thread are not checked twice
+    mutable bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -638,6 +784,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -648,14 +796,32 @@ public:
 
     uint256 GetHash() const
     {
-        if (nVersion > 6)
-            return Hash(BEGIN(nVersion), END(nNonce));
-        else
-            return GetPoWHash();
+        // the header fields are public, so validate the memo against them
+        if (!fHashCached || memcmp(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader)) != 0)
+        {
+            if (nVersion > 6)
+                hashCached = Hash(BEGIN(nVersion), END(nNonce));
+            else
+                hashCached = scrypt_blockhash(CVOIDBEGIN(nVersion));
+            memcpy(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader));
+            fHashCached = true;
+        }
+        return hashCached;
+    }
+
+    // Seed the memo with a hash computed elsewhere (see PrecomputeBlockHashes)
+    void SetCachedHash(const uint256& hash) const
+    {
+        memcpy(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader));
+        hashCached = hash;
+        fHashCached = true;
     }
 
     uint256 GetPoWHash() const
     {
+        // legacy blocks are identified by their scrypt hash, which is memoized
+        if (nVersion <= 6)
+            return GetHash();
         return scrypt_blockhash(CVOIDBEGIN(nVersion));
     }
 
@@ -753,51 +919,53 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
+        // Index header followed by the block, appended in one write
+        unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        ssBlock.reserve(MESSAGE_START_SIZE + sizeof(nSize) + nSize);
+        ssBlock << FLATDATA(Params().MessageStart()) << nSize << *this;
 
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
+        unsigned int nHeaderPos;
+        if (!blockFileWriter.Write(&ssBlock[0], ssBlock.size(), nFileRet, nHeaderPos))
+            return error("CBlock::WriteToDisk() : write failed");
+        nBlockPosRet = nHeaderPos + MESSAGE_START_SIZE + sizeof(nSize);
 
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
+        // Commit to disk before returning, except while catching up where
+        // the writer shares one fsync between several hundred blocks. Blocks
+        // that become the tip are synced by SetBestChain before the index
+        // records them.
+        blockFileWriter.Commit(!IsInitialBlockDownload());
 
         return true;
     }
 
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true, bool fCheckHeader=true)
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
+        // Read block, or only its fixed size header
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        if (fReadTransactions)
+        {
+            if (!ReadRawBlockFromDisk(ssBlock, nFile, nBlockPos))
+                return error("CBlock::ReadFromDisk() : ReadRawBlockFromDisk failed");
+        }
+        else
+        {
+            ssBlock.nType |= SER_BLOCKHEADERONLY;
+            ssBlock.resize(::GetSerializeSize(*this, ssBlock.nType, ssBlock.nVersion));
+            if (blockFileReader.Read(nFile, nBlockPos, &ssBlock[0], ssBlock.size()) != (int)ssBlock.size())
+                return error("CBlock::ReadFromDisk() : read header failed");
+        }
         try {
-            filein >> *this;
+            ssBlock >> *this;
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
         }
 
         // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
+        if (fReadTransactions && fCheckHeader && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -857,39 +1025,46 @@ private:
 class CBlockIndex
 {
 public:
-    const uint256* phashBlock;
+    // Fields are grouped by access: what chain walks and kernel checks read
+    // comes first and shares the leading cache line, the rest is packed
+    // without padding. Entries are allocated from blockIndexArena.
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    uint256 nChainTrust; // ppcoin: trust score of block chain
+    const uint256* phashBlock;
     int nHeight;
-
-    int64_t nMint;
-    uint64_t nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum
     {
         BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+        BLOCK_LOW_S_SIG      = (1 << 3), // block signature is stored in low-S form
     };
 
+    // block header
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    int nVersion;
+
+    uint256 hashProof;
     uint256 nStakeModifier; // hash modifier for proof-of-stake
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+
+    int64_t nMint;
+    uint64_t nMoneySupply;
+
+    // coin-days spent by the coinstake, -1 until known (not stored on disk)
+    int64_t nStakeWeightSpent;
+
+    unsigned int nFile;
+    unsigned int nBlockPos;
 
     // proof-of-stake specific fields
     COutPoint prevoutStake;
     unsigned int nStakeTime;
 
-    uint256 hashProof;
-
-    // block header
-    int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    unsigned int nNonce;
 
     CBlockIndex()
     {
@@ -907,6 +1082,7 @@ public:
         hashProof = 0;
         prevoutStake.SetNull();
         nStakeTime = 0;
+        nStakeWeightSpent = -1;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -929,6 +1105,7 @@ public:
         nFlags = 0;
         nStakeModifier = 0;
         hashProof = 0;
+        nStakeWeightSpent = -1;
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
@@ -973,10 +1150,7 @@ public:
 
     uint256 GetBlockTrust() const;
 
-    bool IsInMainChain() const
-    {
-        return (pnext || this == pindexBest);
-    }
+    bool IsInMainChain() const;
 
     bool CheckIndex() const
     {
@@ -1068,6 +1242,90 @@ public:
 
 
 
+/** The active block chain indexed by height. It is kept in step with the
+ * pnext links of the best chain so that height lookups and main chain
+ * membership tests do not have to walk the chain.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Genesis block of this chain, or NULL if empty */
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Tip of this chain, or NULL if empty */
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Block at the given height in this chain, or NULL if out of range */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Successor of pindex in this chain, or NULL if pindex is the tip or not in this chain */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Height of the tip, -1 if empty */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Make pindex the tip, replacing the blocks above the fork point */
+    void SetTip(CBlockIndex* pindex);
+
+    /** Last common block of this chain and the branch ending at pindex */
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+};
+
+extern CChain chainActive;
+
+/** Allocates block index entries from large contiguous chunks instead of
+ * one heap block each. Entries are never freed. Guarded by cs_main.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    size_t nChunkUsed;
+
+public:
+    CBlockIndexArena() : nChunkUsed(0) {}
+
+    /** Uninitialized storage for one CBlockIndex, to be used with placement
+     *  new. Like new, throws std::bad_alloc instead of returning NULL. */
+    void* Allocate();
+};
+
+extern CBlockIndexArena blockIndexArena;
+
+inline bool CBlockIndex::IsInMainChain() const
+{
+    return chainActive.Contains(this);
+}
+
+
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -1089,6 +1347,7 @@ public:
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        blockHash = pindex->GetBlockHash();
     }
 
     IMPLEMENT_SERIALIZE
@@ -1128,7 +1387,9 @@ public:
 
     uint256 GetBlockHash() const
     {
-        if (fUseFastIndex && (nTime < GetAdjustedTime() - 24 * 60 * 60) && blockHash != 0)
+        // Every record is written with the hash of its block, only recompute
+        // it for old records or when -fastindex=0 asks to verify them
+        if (fUseFastIndex && blockHash != 0)
             return blockHash;
 
         CBlock block;
@@ -1184,7 +1445,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1211,6 +1472,12 @@ public:
         return vHave.empty();
     }
 
+    // Put hashes of blocks the caller knows only by header in front
+    void Prepend(const std::vector<uint256>& vHashes)
+    {
+        vHave.insert(vHave.begin(), vHashes.begin(), vHashes.end());
+    }
+
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
@@ -1219,9 +1486,15 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, jumping straight there on the active chain
+            int nHeight = pindex->nHeight - nStep;
+            if (nHeight < 0)
+                pindex = NULL;
+            else if (chainActive.Contains(pindex))
+                pindex = chainActive[nHeight];
+            else
+                while (pindex->nHeight > nHeight)
+                    pindex = pindex->pprev;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1235,7 +1508,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1254,7 +1527,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1270,7 +1543,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1290,6 +1563,28 @@ public:
     }
 };
 
+/** Sequential reader for external block files. The file is read in large
+ *  chunks and the message start markers are searched in memory, instead of
+ *  seeking and reading a fresh 64 KiB window for every block. */
+class CExternalBlockReader
+{
+private:
+    FILE* file;
+    std::vector<char> vBuf;
+    unsigned int nBegin;
+    unsigned int nEnd;
+    bool fEof;
+
+    // Make at least nNeed unread bytes available, false at end of file
+    bool Fill(unsigned int nNeed);
+
+public:
+    CExternalBlockReader(FILE* fileIn, unsigned int nBufferSize = 8 << 20) : file(fileIn), vBuf(nBufferSize), nBegin(0), nEnd(0), fEof(false) {}
+
+    // Serialized bytes of the next block, false when the file is exhausted
+    bool Next(std::vector<char>& vchBlock);
+};
+
 
 
 
@@ -14,6 +14,13 @@
 #include <string.h>
 #endif
 
+// On Linux the socket thread waits with edge-triggered epoll, which does
+// not limit descriptors to FD_SETSIZE; select() remains the fallback
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -50,11 +57,14 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
 CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -70,6 +80,12 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+// Raised when ThreadMessageHandler has work, so it does not sleep through it
+static boost::condition_variable condMsgHandler;
+static boost::mutex mutexMsgHandler;
+static bool fMsgHandlerWake = false;
+static int nMsgHandlerThreads = 1;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -529,9 +545,19 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgHandler);
+        fMsgHandlerWake = true;
+    }
+    condMsgHandler.notify_all();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -554,10 +580,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete())
+        if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
+    if (fComplete)
+        WakeMessageHandler();
     return true;
 }
 
@@ -620,6 +650,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 void SocketSendData(CNode *pnode)
 {
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fSendBufferFull = pnode->nSendSize >= SendBufferSize();
 
     while (it != pnode->vSendMsg.end()) {
         const CSerializeData &data = *it;
@@ -658,13 +689,81 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // The message handler skips a peer's messages while its send buffer is full
+    if (fSendBufferFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler();
+
+#ifdef USE_EPOLL
+    // Only wait for writability while there is something left to send
+    bool fPollOut = !pnode->vSendMsg.empty();
+    if (pnode->fSocketRegistered && fPollOut != pnode->fSocketPollOut && pnode->hSocket != INVALID_SOCKET)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (fPollOut ? (uint32_t)EPOLLOUT : 0u);
+        event.data.ptr = pnode;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event) == 0)
+            pnode->fSocketPollOut = fPollOut;
+    }
+#endif
+}
+
+#ifdef USE_EPOLL
+// Add the socket of a new node to the epoll set, false to retry later
+static bool RegisterSocket(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
+    if (pnode->hSocket != INVALID_SOCKET)
+    {
+        // The version message of an outbound node may still be queued
+        bool fPollOut = !pnode->vSendMsg.empty();
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (fPollOut ? (uint32_t)EPOLLOUT : 0u);
+        event.data.ptr = pnode;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+        {
+            LogPrintf("epoll_ctl add failed: %d\n", errno);
+            pnode->CloseSocketDisconnect();
+        }
+        pnode->fSocketPollOut = fPollOut;
+    }
+    pnode->fSocketRegistered = true;
+    return true;
 }
+#endif
 
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fEpoll = false;
+    bool fMoreWork = false;
+
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create(1024);
+        if (hEpoll == -1)
+            LogPrintf("epoll_create failed: %d, falling back to select\n", errno);
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            // Level-triggered: one connection is accepted per wakeup
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (hEpoll != -1 && epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+            {
+                LogPrintf("epoll_ctl add of listening socket failed: %d, falling back to select\n", errno);
+                close(hEpoll);
+                hEpoll = -1;
+            }
+        }
+    }
+    fEpoll = hEpoll != -1;
+#endif
 
     while (true)
     {
@@ -721,6 +820,7 @@ void ThreadSocketHandler()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        g_signals.FinalizeNode(pnode);
                         delete pnode;
                     }
                 }
@@ -747,58 +847,98 @@ void ThreadSocketHandler()
         FD_ZERO(&fdsetError);
         SOCKET hSocketMax = 0;
         bool have_fds = false;
+        bool fListenReady = false;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+#ifdef USE_EPOLL
+        if (fEpoll)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            // Nodes are added once; their readiness then arrives as edges
+            // and stays recorded in the node until recv/send run dry
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (!pnode->fSocketRegistered)
+                        RegisterSocket(pnode);
+            }
+
+            struct epoll_event events[256];
+            int nEvents = epoll_wait(hEpoll, events, 256, fMoreWork ? 0 : timeout.tv_usec / 1000);
+            boost::this_thread::interruption_point();
+            if (nEvents < 0 && errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(timeout.tv_usec/1000);
+            }
+            for (int i = 0; i < nEvents; i++)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (!pnode)
+                {
+                    fListenReady = true;
                     continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+            }
+        }
+        else
+#endif
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend) {
+                            // do not read, if draining write queue
+                            if (!pnode->vSendMsg.empty())
+                                FD_SET(pnode->hSocket, &fdsetSend);
+                            else
+                                FD_SET(pnode->hSocket, &fdsetRecv);
+                            FD_SET(pnode->hSocket, &fdsetError);
+                            hSocketMax = max(hSocketMax, pnode->hSocket);
+                            have_fds = true;
+                        }
                     }
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
+        fMoreWork = false;
 
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && (fEpoll ? fListenReady : FD_ISSET(hListenSocket, &fdsetRecv)))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -864,7 +1004,13 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (!fEpoll)
+            {
+                pnode->fSocketReadable = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                pnode->fSocketWritable = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+            // do not read, if draining write queue
+            if (pnode->fSocketReadable && !(fEpoll && pnode->fSocketPollOut))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -885,6 +1031,8 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // no new edge comes until the socket has been drained
+                            fMoreWork = true;
                         }
                         else if (nBytes == 0)
                         {
@@ -903,6 +1051,8 @@ void ThreadSocketHandler()
                                     LogPrintf("socket recv error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
                             }
+                            else if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
                         }
                     }
                 }
@@ -913,11 +1063,15 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
+                    // whatever is left waits for the next EPOLLOUT edge
                     SocketSendData(pnode);
+                    pnode->fSocketWritable = false;
+                }
             }
 
             //
@@ -1400,7 +1554,7 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1418,21 +1572,36 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
-            StartSync(vNodesCopy);
-
-        // Poll the connected nodes for messages
+        // Sync node selection and trickling are left to the first thread,
+        // so adding threads does not make them happen more often
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        if (nThread == 0)
+        {
+            if (!fHaveSyncNode)
+                StartSync(vNodesCopy);
+
+            if (!vNodesCopy.empty())
+                pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        }
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Each thread starts at a different node, so they mostly do not
+        // reach for the same ones
+        size_t nNodes = vNodesCopy.size();
+        size_t nStart = nNodes ? (nThread * nNodes / nMsgHandlerThreads) % nNodes : 0;
+        for (size_t i = 0; i < nNodes; i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % nNodes];
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is working on this node; its messages have to
+            // be handled in order, so leave it to that thread
+            TRY_LOCK(pnode->cs_msgHandler, lockHandler);
+            if (!lockHandler)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1467,8 +1636,15 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        // Sleep until a message completes or other work is signalled. The
+        // timeout keeps the periodic work in SendMessages (trickling, pings,
+        // delayed getdata) ticking.
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            if (fSleep && !fMsgHandlerWake)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMsgHandlerWake = false;
+        }
     }
 }
 
@@ -1658,7 +1834,14 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMsgHandlerThreads = GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
+    if (nMsgHandlerThreads < 1)
+        nMsgHandlerThreads = 1;
+    else if (nMsgHandlerThreads > MAX_MSGHANDLER_THREADS)
+        nMsgHandlerThreads = MAX_MSGHANDLER_THREADS;
+    LogPrintf("Using %d message handler threads\n", nMsgHandlerThreads);
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1692,6 +1875,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1703,15 +1890,16 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    // Share the memory pool's copy when it has one
+    CTransactionRef ptx = mempool.get(hash);
+    if (!ptx)
+        ptx = MakeTransactionRef(tx);
+    RelayTransaction(ptx);
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
-    CInv inv(MSG_TX, hash);
+    CInv inv(MSG_TX, ptx->GetHash());
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1721,8 +1909,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep a reference so it can be served to peers asking for it even
+        // after it left the memory pool
+        mapRelay.insert(std::make_pair(inv, ptx));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
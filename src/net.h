@@ -20,6 +20,7 @@
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
+#include "core.h"
 #include "hash.h"
 
 class CNode;
@@ -31,6 +32,9 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Default and maximum number of threads running ProcessMessages/SendMessages (-msghandlerthreads) */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+static const int MAX_MSGHANDLER_THREADS = 16;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -48,12 +52,16 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Let ThreadMessageHandler know there is a message, inventory or send
+ *  buffer space waiting for it, instead of it finding out on its next poll */
+void WakeMessageHandler();
 
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (CNode*)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -98,7 +106,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -193,6 +201,9 @@ public:
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread currently processing this node, so
+    // that its messages are handled in order and never by two threads at once
+    CCriticalSection cs_msgHandler;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -211,6 +222,14 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Readiness of the socket as last reported by the socket thread's
+    // select() or epoll, only used by that thread
+    bool fSocketReadable;
+    bool fSocketWritable;
+    // Whether the socket is in the epoll set and watched for writability,
+    // guarded by cs_vSend
+    bool fSocketRegistered;
+    bool fSocketPollOut;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
 protected:
@@ -228,6 +247,19 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first download, guarded by cs_main: the blocks requested
+    // from this peer and when, the headers it was the first to send, and the
+    // highest header it sent or announced the block of
+    std::map<uint256, int64_t> mapBlocksInFlight;
+    std::set<uint256> setBlockHeaders;
+    uint256 hashBestKnownHeader;
+    int nBestKnownHeaderHeight;
+    int64_t nLastGetHeaders;
+    // where hashBestKnownHeader meets the header chain, as last computed
+    uint256 hashCommonHeaderFrom;
+    unsigned int nCommonHeaderVersion;
+    int nCommonHeaderHeight;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
@@ -271,6 +303,10 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        fSocketRegistered = false;
+        fSocketPollOut = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
@@ -278,6 +314,12 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        hashBestKnownHeader = 0;
+        nBestKnownHeaderHeight = -1;
+        nLastGetHeaders = 0;
+        hashCommonHeaderFrom = 0;
+        nCommonHeaderVersion = 0;
+        nCommonHeaderHeight = -1;
         fStartSync = false;
         fGetAddr = false;
         nMisbehavior = 0;
@@ -663,11 +705,11 @@ inline void RelayInventory(const CInv& inv)
         BOOST_FOREACH(CNode* pnode, vNodes)
             pnode->PushInventory(inv);
     }
+    WakeMessageHandler();
 }
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -144,6 +144,7 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
+    obj.push_back(Pair("averageweightspent", stakeWeightStats.GetAverage()));
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
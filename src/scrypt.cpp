@@ -131,6 +131,147 @@ static inline void scrypt_core(unsigned int *X, unsigned int *V)
 
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCRYPT_MULTILANE
+
+#include <immintrin.h>
+#include <boost/thread/once.hpp>
+
+/* Multi-lane scrypt_core: N independent hashes are interleaved word by word
+   (word k of lane l lives at X[k * N + l]), so one vector instruction advances
+   every lane, and the lanes' independent scratchpad reads overlap in memory.
+   The kernels are compiled for their instruction set regardless of the
+   global flags and only selected at runtime if the CPU supports it. */
+
+#define SALSA_QUARTERROUNDS(ADD, XOR, ROTL)                                                              \
+    x[ 4] = XOR(x[ 4], ROTL(ADD(x[ 0], x[12]),  7));  x[ 9] = XOR(x[ 9], ROTL(ADD(x[ 5], x[ 1]),  7));  \
+    x[14] = XOR(x[14], ROTL(ADD(x[10], x[ 6]),  7));  x[ 3] = XOR(x[ 3], ROTL(ADD(x[15], x[11]),  7));  \
+    x[ 8] = XOR(x[ 8], ROTL(ADD(x[ 4], x[ 0]),  9));  x[13] = XOR(x[13], ROTL(ADD(x[ 9], x[ 5]),  9));  \
+    x[ 2] = XOR(x[ 2], ROTL(ADD(x[14], x[10]),  9));  x[ 7] = XOR(x[ 7], ROTL(ADD(x[ 3], x[15]),  9));  \
+    x[12] = XOR(x[12], ROTL(ADD(x[ 8], x[ 4]), 13));  x[ 1] = XOR(x[ 1], ROTL(ADD(x[13], x[ 9]), 13));  \
+    x[ 6] = XOR(x[ 6], ROTL(ADD(x[ 2], x[14]), 13));  x[11] = XOR(x[11], ROTL(ADD(x[ 7], x[ 3]), 13));  \
+    x[ 0] = XOR(x[ 0], ROTL(ADD(x[12], x[ 8]), 18));  x[ 5] = XOR(x[ 5], ROTL(ADD(x[ 1], x[13]), 18));  \
+    x[10] = XOR(x[10], ROTL(ADD(x[ 6], x[ 2]), 18));  x[15] = XOR(x[15], ROTL(ADD(x[11], x[ 7]), 18));  \
+    x[ 1] = XOR(x[ 1], ROTL(ADD(x[ 0], x[ 3]),  7));  x[ 6] = XOR(x[ 6], ROTL(ADD(x[ 5], x[ 4]),  7));  \
+    x[11] = XOR(x[11], ROTL(ADD(x[10], x[ 9]),  7));  x[12] = XOR(x[12], ROTL(ADD(x[15], x[14]),  7));  \
+    x[ 2] = XOR(x[ 2], ROTL(ADD(x[ 1], x[ 0]),  9));  x[ 7] = XOR(x[ 7], ROTL(ADD(x[ 6], x[ 5]),  9));  \
+    x[ 8] = XOR(x[ 8], ROTL(ADD(x[11], x[10]),  9));  x[13] = XOR(x[13], ROTL(ADD(x[12], x[15]),  9));  \
+    x[ 3] = XOR(x[ 3], ROTL(ADD(x[ 2], x[ 1]), 13));  x[ 4] = XOR(x[ 4], ROTL(ADD(x[ 7], x[ 6]), 13));  \
+    x[ 9] = XOR(x[ 9], ROTL(ADD(x[ 8], x[11]), 13));  x[14] = XOR(x[14], ROTL(ADD(x[13], x[12]), 13));  \
+    x[ 0] = XOR(x[ 0], ROTL(ADD(x[ 3], x[ 2]), 18));  x[ 5] = XOR(x[ 5], ROTL(ADD(x[ 4], x[ 7]), 18));  \
+    x[10] = XOR(x[10], ROTL(ADD(x[ 9], x[ 8]), 18));  x[15] = XOR(x[15], ROTL(ADD(x[14], x[13]), 18));
+
+/* Second half of scrypt_core: every lane picks its own scratchpad entry */
+#define SCRYPT_CORE_NWAY(LANES, SALSA)                                          \
+    for (unsigned int i = 0; i < 1024; i++) {                                   \
+        memcpy(&V[i * 32 * LANES], X, 128 * LANES);                             \
+        SALSA(&X[0], &X[16 * LANES]);                                           \
+        SALSA(&X[16 * LANES], &X[0]);                                           \
+    }                                                                           \
+    for (unsigned int i = 0; i < 1024; i++) {                                   \
+        for (unsigned int l = 0; l < LANES; l++) {                              \
+            const uint32_t *Vj = &V[32 * LANES * (X[16 * LANES + l] & 1023)];   \
+            for (unsigned int k = 0; k < 32; k++)                               \
+                X[k * LANES + l] ^= Vj[k * LANES + l];                          \
+        }                                                                       \
+        SALSA(&X[0], &X[16 * LANES]);                                           \
+        SALSA(&X[16 * LANES], &X[0]);                                           \
+    }
+
+#define ADD_SSE2(a, b) _mm_add_epi32(a, b)
+#define XOR_SSE2(a, b) _mm_xor_si128(a, b)
+#define ROTL_SSE2(a, n) _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+
+__attribute__((target("sse2")))
+static inline void xor_salsa8_4way(uint32_t *B, const uint32_t *Bx)
+{
+    __m128i b[16], x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = b[i] = _mm_xor_si128(_mm_load_si128((const __m128i *)&B[4 * i]), _mm_load_si128((const __m128i *)&Bx[4 * i]));
+    for (int i = 0; i < 8; i += 2) {
+        SALSA_QUARTERROUNDS(ADD_SSE2, XOR_SSE2, ROTL_SSE2)
+    }
+    for (int i = 0; i < 16; i++)
+        _mm_store_si128((__m128i *)&B[4 * i], _mm_add_epi32(b[i], x[i]));
+}
+
+__attribute__((target("sse2")))
+static void scrypt_core_4way(uint32_t *X, uint32_t *V)
+{
+    SCRYPT_CORE_NWAY(4, xor_salsa8_4way)
+}
+
+#define ADD_AVX2(a, b) _mm256_add_epi32(a, b)
+#define XOR_AVX2(a, b) _mm256_xor_si256(a, b)
+#define ROTL_AVX2(a, n) _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+
+__attribute__((target("avx2")))
+static inline void xor_salsa8_8way(uint32_t *B, const uint32_t *Bx)
+{
+    __m256i b[16], x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = b[i] = _mm256_xor_si256(_mm256_load_si256((const __m256i *)&B[8 * i]), _mm256_load_si256((const __m256i *)&Bx[8 * i]));
+    for (int i = 0; i < 8; i += 2) {
+        SALSA_QUARTERROUNDS(ADD_AVX2, XOR_AVX2, ROTL_AVX2)
+    }
+    for (int i = 0; i < 16; i++)
+        _mm256_store_si256((__m256i *)&B[8 * i], _mm256_add_epi32(b[i], x[i]));
+}
+
+__attribute__((target("avx2")))
+static void scrypt_core_8way(uint32_t *X, uint32_t *V)
+{
+    SCRYPT_CORE_NWAY(8, xor_salsa8_8way)
+}
+
+static int nScryptLanes = 1;
+static boost::once_flag scryptLanesOnce = BOOST_ONCE_INIT;
+
+static void scrypt_detect_lanes()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        nScryptLanes = 8;
+    else if (__builtin_cpu_supports("sse2"))
+        nScryptLanes = 4;
+}
+
+/* Detected once; the batch hashers run on several threads at a time */
+static int scrypt_best_lanes()
+{
+    boost::call_once(scrypt_detect_lanes, scryptLanesOnce);
+    return nScryptLanes;
+}
+
+/* Hash nLanes 80 byte headers at once */
+static void scrypt_blockhash_nway(const unsigned char *headers, uint256 *out, unsigned int nLanes, unsigned char *scratchpad)
+{
+    uint32_t *X = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    uint32_t *V = X + 32 * nLanes;
+    uint32_t T[32];
+
+    for (unsigned int l = 0; l < nLanes; l++) {
+        const uint8_t *pheader = headers + 80 * l;
+        PBKDF2_SHA256(pheader, 80, pheader, 80, 1, (uint8_t *)T, 128);
+        for (unsigned int k = 0; k < 32; k++)
+            X[k * nLanes + l] = T[k];
+    }
+
+    if (nLanes == 8)
+        scrypt_core_8way(X, V);
+    else
+        scrypt_core_4way(X, V);
+
+    for (unsigned int l = 0; l < nLanes; l++) {
+        const uint8_t *pheader = headers + 80 * l;
+        for (unsigned int k = 0; k < 32; k++)
+            T[k] = X[k * nLanes + l];
+        out[l] = 0;
+        PBKDF2_SHA256(pheader, 80, (uint8_t *)T, 128, 1, (uint8_t *)&out[l], 32);
+    }
+}
+#endif
+
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
    scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
    r = 1, p = 1, N = 1024
@@ -196,3 +337,26 @@ uint256 scrypt_blockhash(const void* input)
     return scrypt_nosalt(input, 80, scratchpad);
 }
 
+
+void scrypt_blockhash_batch(const void* headers, unsigned int n, uint256* out)
+{
+    const unsigned char *pheaders = (const unsigned char *)headers;
+    unsigned int i = 0;
+#ifdef SCRYPT_MULTILANE
+    unsigned int nLanes = scrypt_best_lanes();
+    if (nLanes > 1 && n >= 4) {
+        unsigned char *scratchpad = (unsigned char *)malloc(nLanes * (SCRYPT_BUFFER_SIZE + 128));
+        if (scratchpad) {
+            for (; i + nLanes <= n; i += nLanes)
+                scrypt_blockhash_nway(pheaders + 80 * i, out + i, nLanes, scratchpad);
+            if (nLanes == 8 && i + 4 <= n) {
+                scrypt_blockhash_nway(pheaders + 80 * i, out + i, 4, scratchpad);
+                i += 4;
+            }
+            free(scratchpad);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = scrypt_blockhash(pheaders + 80 * i);
+}
@@ -11,5 +11,7 @@ uint256 scrypt_salted_multiround_hash(const void* input, size_t inputlen, const
 uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt, size_t saltlen);
 uint256 scrypt_hash(const void* input, size_t inputlen);
 uint256 scrypt_blockhash(const void* input);
+/** Hash n consecutive 80 byte headers, several at a time where the CPU allows */
+void scrypt_blockhash_batch(const void* headers, unsigned int n, uint256* out);
 
 #endif // SCRYPT_MINE_H
@@ -0,0 +1,980 @@
+// Copyright (c) 2014 The GloveCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/thread/once.hpp>
+
+namespace secp256k1 {
+
+#if defined(__SIZEOF_INT128__)
+
+typedef unsigned __int128 uint128;
+
+namespace {
+
+//
+// Field elements modulo p = 2^256 - 2^32 - 977.
+// Four little endian 64 bit limbs, always kept fully reduced.
+//
+struct fe
+{
+    uint64_t n[4];
+};
+
+const uint64_t P0 = 0xFFFFFFFEFFFFFC2FULL;
+const uint64_t PM = 0xFFFFFFFFFFFFFFFFULL;
+const uint64_t PC = 0x1000003D1ULL; // 2^256 - p
+
+inline void fe_set_int(fe &r, uint64_t a)
+{
+    r.n[0] = a;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+inline bool fe_is_zero(const fe &a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3]) == 0;
+}
+
+inline bool fe_equal(const fe &a, const fe &b)
+{
+    return a.n[0] == b.n[0] && a.n[1] == b.n[1] && a.n[2] == b.n[2] && a.n[3] == b.n[3];
+}
+
+inline bool fe_is_odd(const fe &a)
+{
+    return a.n[0] & 1;
+}
+
+inline bool fe_geq_p(const uint64_t n[4])
+{
+    return n[3] == PM && n[2] == PM && n[1] == PM && n[0] >= P0;
+}
+
+// n += 2^256 - p, dropping the carry out of the top limb
+inline void fe_add_pc(uint64_t n[4])
+{
+    uint128 t = (uint128)n[0] + PC;
+    n[0] = (uint64_t)t;
+    t >>= 64;
+    for (int i = 1; i < 4; i++) {
+        t += n[i];
+        n[i] = (uint64_t)t;
+        t >>= 64;
+    }
+}
+
+bool fe_set_b32(fe &r, const unsigned char *b32)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (v << 8) | b32[(3 - i) * 8 + j];
+        r.n[i] = v;
+    }
+    return !fe_geq_p(r.n);
+}
+
+void fe_get_b32(unsigned char *b32, const fe &a)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            b32[(3 - i) * 8 + j] = (unsigned char)(a.n[i] >> (56 - 8 * j));
+}
+
+void fe_add(fe &r, const fe &a, const fe &b)
+{
+    uint128 t = 0;
+    for (int i = 0; i < 4; i++) {
+        t += (uint128)a.n[i] + b.n[i];
+        r.n[i] = (uint64_t)t;
+        t >>= 64;
+    }
+    if (t || fe_geq_p(r.n))
+        fe_add_pc(r.n);
+}
+
+void fe_sub(fe &r, const fe &a, const fe &b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++) {
+        uint128 t = (uint128)a.n[i] - b.n[i] - borrow;
+        r.n[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+    if (borrow) {
+        // wrapped below zero: add p back, i.e. subtract 2^256 - p
+        uint128 t = (uint128)r.n[0] - PC;
+        r.n[0] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+        for (int i = 1; i < 4; i++) {
+            t = (uint128)r.n[i] - borrow;
+            r.n[i] = (uint64_t)t;
+            borrow = (uint64_t)(t >> 64) & 1;
+        }
+    }
+}
+
+void fe_negate(fe &r, const fe &a)
+{
+    fe zero;
+    fe_set_int(zero, 0);
+    fe_sub(r, zero, a);
+}
+
+void fe_mul(fe &r, const fe &a, const fe &b)
+{
+    uint64_t t[8] = {0};
+    for (int i = 0; i < 4; i++) {
+        uint128 c = 0;
+        for (int j = 0; j < 4; j++) {
+            c += (uint128)a.n[i] * b.n[j] + t[i + j];
+            t[i + j] = (uint64_t)c;
+            c >>= 64;
+        }
+        t[i + 4] = (uint64_t)c;
+    }
+
+    // Fold the upper half down using 2^256 == 2^32 + 977 (mod p), twice
+    uint64_t n[4];
+    uint128 c = 0;
+    for (int i = 0; i < 4; i++) {
+        c += (uint128)t[4 + i] * PC + t[i];
+        n[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    c = (uint128)(uint64_t)c * PC + n[0];
+    n[0] = (uint64_t)c;
+    c >>= 64;
+    for (int i = 1; i < 4; i++) {
+        c += n[i];
+        n[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    if (c)
+        fe_add_pc(n);
+    if (fe_geq_p(n))
+        fe_add_pc(n);
+    memcpy(r.n, n, sizeof(n));
+}
+
+inline void fe_sqr(fe &r, const fe &a)
+{
+    fe_mul(r, a, a);
+}
+
+inline void fe_sqr_n(fe &r, const fe &a, int n)
+{
+    r = a;
+    while (n--)
+        fe_sqr(r, r);
+}
+
+// Shared prefix of the inversion and square root addition chains: the
+// exponents (p + 1)/4 and p - 2 consist of blocks of 1s of length 2, 22 and 223.
+void fe_pow_prefix(fe &x2, fe &x22, fe &x223, const fe &a)
+{
+    fe x3, x6, x9, x11, x44, x88, x176, x220, t;
+    fe_sqr(t, a);
+    fe_mul(x2, t, a);
+    fe_sqr(t, x2);
+    fe_mul(x3, t, a);
+    fe_sqr_n(t, x3, 3);
+    fe_mul(x6, t, x3);
+    fe_sqr_n(t, x6, 3);
+    fe_mul(x9, t, x3);
+    fe_sqr_n(t, x9, 2);
+    fe_mul(x11, t, x2);
+    fe_sqr_n(t, x11, 11);
+    fe_mul(x22, t, x11);
+    fe_sqr_n(t, x22, 22);
+    fe_mul(x44, t, x22);
+    fe_sqr_n(t, x44, 44);
+    fe_mul(x88, t, x44);
+    fe_sqr_n(t, x88, 88);
+    fe_mul(x176, t, x88);
+    fe_sqr_n(t, x176, 44);
+    fe_mul(x220, t, x44);
+    fe_sqr_n(t, x220, 3);
+    fe_mul(x223, t, x3);
+}
+
+// r = a^(p - 2) = 1/a
+void fe_inv(fe &r, const fe &a)
+{
+    fe x2, x22, x223, t;
+    fe_pow_prefix(x2, x22, x223, a);
+    fe_sqr_n(t, x223, 23);
+    fe_mul(t, t, x22);
+    fe_sqr_n(t, t, 5);
+    fe_mul(t, t, a);
+    fe_sqr_n(t, t, 3);
+    fe_mul(t, t, x2);
+    fe_sqr_n(t, t, 2);
+    fe_mul(r, t, a);
+}
+
+// r = a^((p + 1)/4); returns whether a actually is a square
+bool fe_sqrt(fe &r, const fe &a)
+{
+    fe x2, x22, x223, t;
+    fe_pow_prefix(x2, x22, x223, a);
+    fe_sqr_n(t, x223, 23);
+    fe_mul(t, t, x22);
+    fe_sqr_n(t, t, 6);
+    fe_mul(t, t, x2);
+    fe_sqr_n(r, t, 2);
+    fe_sqr(t, r);
+    return fe_equal(t, a);
+}
+
+//
+// Scalars modulo the group order n.
+//
+struct scalar
+{
+    uint64_t n[4];
+};
+
+const uint64_t N[4] = {0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+const uint64_t NC[3] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 0x1ULL}; // 2^256 - n
+const uint64_t NH[4] = {0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL}; // n/2
+const uint64_t PMINUSN[4] = {0x402DA1722FC9BAEEULL, 0x4551231950B75FC4ULL, 0x1ULL, 0x0ULL};
+
+inline bool lt_256(const uint64_t *a, const uint64_t *b)
+{
+    for (int i = 3; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    }
+    return false;
+}
+
+inline bool scalar_is_zero(const scalar &a)
+{
+    return (a.n[0] | a.n[1] | a.n[2] | a.n[3]) == 0;
+}
+
+inline bool scalar_is_high(const scalar &a)
+{
+    return lt_256(NH, a.n);
+}
+
+// a += 2^256 - n, dropping the carry out of the top limb
+inline void scalar_add_nc(uint64_t a[4])
+{
+    uint128 t = 0;
+    for (int i = 0; i < 4; i++) {
+        t += (uint128)a[i] + (i < 3 ? NC[i] : 0);
+        a[i] = (uint64_t)t;
+        t >>= 64;
+    }
+}
+
+// Returns whether the value was at least n (it is reduced in that case)
+bool scalar_set_b32(scalar &r, const unsigned char *b32)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (v << 8) | b32[(3 - i) * 8 + j];
+        r.n[i] = v;
+    }
+    bool fOverflow = !lt_256(r.n, N);
+    if (fOverflow)
+        scalar_add_nc(r.n);
+    return fOverflow;
+}
+
+void scalar_reduce_512(scalar &r, const uint64_t in[8])
+{
+    uint64_t t[8];
+    memcpy(t, in, sizeof(t));
+    // t = lo + hi * (2^256 - n) until the high half is gone (at most four rounds)
+    while (t[4] | t[5] | t[6] | t[7]) {
+        uint64_t u[8] = {t[0], t[1], t[2], t[3], 0, 0, 0, 0};
+        for (int i = 0; i < 4; i++) {
+            uint128 c = 0;
+            for (int j = 0; j < 3; j++) {
+                c += (uint128)t[4 + i] * NC[j] + u[i + j];
+                u[i + j] = (uint64_t)c;
+                c >>= 64;
+            }
+            for (int k = i + 3; c && k < 8; k++) {
+                c += u[k];
+                u[k] = (uint64_t)c;
+                c >>= 64;
+            }
+        }
+        memcpy(t, u, sizeof(t));
+    }
+    if (!lt_256(t, N))
+        scalar_add_nc(t);
+    memcpy(r.n, t, sizeof(r.n));
+}
+
+void mul_256(uint64_t t[8], const uint64_t a[4], const uint64_t b[4])
+{
+    memset(t, 0, 8 * sizeof(uint64_t));
+    for (int i = 0; i < 4; i++) {
+        uint128 c = 0;
+        for (int j = 0; j < 4; j++) {
+            c += (uint128)a[i] * b[j] + t[i + j];
+            t[i + j] = (uint64_t)c;
+            c >>= 64;
+        }
+        t[i + 4] = (uint64_t)c;
+    }
+}
+
+void scalar_mul(scalar &r, const scalar &a, const scalar &b)
+{
+    uint64_t t[8];
+    mul_256(t, a.n, b.n);
+    scalar_reduce_512(r, t);
+}
+
+void scalar_add(scalar &r, const scalar &a, const scalar &b)
+{
+    uint128 t = 0;
+    for (int i = 0; i < 4; i++) {
+        t += (uint128)a.n[i] + b.n[i];
+        r.n[i] = (uint64_t)t;
+        t >>= 64;
+    }
+    if (t || !lt_256(r.n, N))
+        scalar_add_nc(r.n);
+}
+
+void scalar_negate(scalar &r, const scalar &a)
+{
+    if (scalar_is_zero(a)) {
+        r = a;
+        return;
+    }
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++) {
+        uint128 t = (uint128)N[i] - a.n[i] - borrow;
+        r.n[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+}
+
+// r = a^(n - 2) = 1/a, using a fixed 4 bit window
+void scalar_inv(scalar &r, const scalar &a)
+{
+    static const uint64_t E[4] = {0xBFD25E8CD036413FULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL};
+    scalar table[16];
+    memset(&table[0], 0, sizeof(table[0]));
+    table[0].n[0] = 1;
+    for (int i = 1; i < 16; i++)
+        scalar_mul(table[i], table[i - 1], a);
+    scalar x = table[0];
+    for (int i = 63; i >= 0; i--) {
+        for (int j = 0; j < 4; j++)
+            scalar_mul(x, x, x);
+        int nibble = (E[i / 16] >> ((i % 16) * 4)) & 0xf;
+        if (nibble)
+            scalar_mul(x, x, table[nibble]);
+    }
+    r = x;
+}
+
+//
+// GLV endomorphism: lambda * (x, y) == (beta * x, y)
+//
+const scalar LAMBDA = {{0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL}};
+const fe BETA = {{0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL}};
+const scalar MINUS_B1 = {{0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0x0ULL, 0x0ULL}};
+const scalar MINUS_B2 = {{0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL}};
+const uint64_t G1[4] = {0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL};
+const uint64_t G2[4] = {0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL};
+
+// round(k * g / 2^384)
+void mul_shift_384(scalar &r, const scalar &k, const uint64_t g[4])
+{
+    uint64_t t[8];
+    mul_256(t, k.n, g);
+    uint128 c = (uint128)t[6] + ((t[5] >> 63) & 1);
+    r.n[0] = (uint64_t)c;
+    c >>= 64;
+    r.n[1] = t[7] + (uint64_t)c;
+    r.n[2] = r.n[3] = 0;
+}
+
+// Split k into k1 + k2 * lambda with k1 and k2 of about 128 bits each
+void scalar_split_lambda(scalar &k1, scalar &k2, const scalar &k)
+{
+    scalar c1, c2, t;
+    mul_shift_384(c1, k, G1);
+    mul_shift_384(c2, k, G2);
+    scalar_mul(c1, c1, MINUS_B1);
+    scalar_mul(c2, c2, MINUS_B2);
+    scalar_add(k2, c1, c2);
+    scalar_mul(t, k2, LAMBDA);
+    scalar_negate(t, t);
+    scalar_add(k1, k, t);
+}
+
+//
+// Group elements in affine and Jacobian coordinates.
+//
+struct ge
+{
+    fe x, y;
+    bool infinity;
+};
+
+struct gej
+{
+    fe x, y, z;
+    bool infinity;
+};
+
+void gej_set_ge(gej &r, const ge &a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    fe_set_int(r.z, 1);
+    r.infinity = a.infinity;
+}
+
+bool ge_is_valid(const ge &a)
+{
+    fe y2, x3, seven;
+    fe_sqr(y2, a.y);
+    fe_sqr(x3, a.x);
+    fe_mul(x3, x3, a.x);
+    fe_set_int(seven, 7);
+    fe_add(x3, x3, seven);
+    return fe_equal(y2, x3);
+}
+
+// Decompress: find the point with the given x coordinate and y parity
+bool ge_set_xo(ge &r, const fe &x, bool fOdd)
+{
+    fe rhs, seven;
+    fe_sqr(rhs, x);
+    fe_mul(rhs, rhs, x);
+    fe_set_int(seven, 7);
+    fe_add(rhs, rhs, seven);
+    if (!fe_sqrt(r.y, rhs))
+        return false;
+    if (fe_is_odd(r.y) != fOdd)
+        fe_negate(r.y, r.y);
+    r.x = x;
+    r.infinity = false;
+    return true;
+}
+
+void ge_set_gej(ge &r, const gej &a)
+{
+    r.infinity = a.infinity;
+    if (a.infinity)
+        return;
+    fe zi, zi2, zi3;
+    fe_inv(zi, a.z);
+    fe_sqr(zi2, zi);
+    fe_mul(zi3, zi2, zi);
+    fe_mul(r.x, a.x, zi2);
+    fe_mul(r.y, a.y, zi3);
+}
+
+// Convert many points at once with a single inversion; none may be infinity
+void ge_set_all_gej(ge *r, const gej *a, int len)
+{
+    fe *prod = new fe[len];
+    prod[0] = a[0].z;
+    for (int i = 1; i < len; i++)
+        fe_mul(prod[i], prod[i - 1], a[i].z);
+    fe u;
+    fe_inv(u, prod[len - 1]);
+    for (int i = len - 1; i >= 0; i--) {
+        fe zi, zi2, zi3;
+        if (i > 0) {
+            fe_mul(zi, u, prod[i - 1]);
+            fe_mul(u, u, a[i].z);
+        } else {
+            zi = u;
+        }
+        fe_sqr(zi2, zi);
+        fe_mul(zi3, zi2, zi);
+        fe_mul(r[i].x, a[i].x, zi2);
+        fe_mul(r[i].y, a[i].y, zi3);
+        r[i].infinity = false;
+    }
+    delete[] prod;
+}
+
+void gej_double(gej &r, const gej &a)
+{
+    // secp256k1 has no point of order two, so y is never zero here
+    if (a.infinity) {
+        r.infinity = true;
+        return;
+    }
+    fe A, B, C, D, E, F, t, x3, y3, z3;
+    fe_sqr(A, a.x);
+    fe_sqr(B, a.y);
+    fe_sqr(C, B);
+    fe_add(t, a.x, B);
+    fe_sqr(t, t);
+    fe_sub(t, t, A);
+    fe_sub(t, t, C);
+    fe_add(D, t, t);
+    fe_add(E, A, A);
+    fe_add(E, E, A);
+    fe_sqr(F, E);
+    fe_mul(z3, a.y, a.z);
+    fe_add(z3, z3, z3);
+    fe_add(t, D, D);
+    fe_sub(x3, F, t);
+    fe_sub(t, D, x3);
+    fe_mul(y3, E, t);
+    fe_add(C, C, C);
+    fe_add(C, C, C);
+    fe_add(C, C, C);
+    fe_sub(y3, y3, C);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+    r.infinity = false;
+}
+
+// Shared tail of the addition formulas
+void gej_add_finish(gej &r, const fe &u1, const fe &s1, const fe &h, const fe &rr, const fe &zh)
+{
+    fe h2, h3, v, t, x3, y3;
+    fe_sqr(h2, h);
+    fe_mul(h3, h2, h);
+    fe_mul(v, u1, h2);
+    fe_sqr(x3, rr);
+    fe_sub(x3, x3, h3);
+    fe_add(t, v, v);
+    fe_sub(x3, x3, t);
+    fe_sub(t, v, x3);
+    fe_mul(y3, rr, t);
+    fe_mul(t, s1, h3);
+    fe_sub(y3, y3, t);
+    r.x = x3;
+    r.y = y3;
+    r.z = zh;
+    r.infinity = false;
+}
+
+void gej_add_ge(gej &r, const gej &a, const ge &b)
+{
+    if (a.infinity) {
+        gej_set_ge(r, b);
+        return;
+    }
+    if (b.infinity) {
+        r = a;
+        return;
+    }
+    fe z12, u2, s2, h, rr, zh;
+    fe_sqr(z12, a.z);
+    fe_mul(u2, b.x, z12);
+    fe_mul(s2, b.y, z12);
+    fe_mul(s2, s2, a.z);
+    fe_sub(h, u2, a.x);
+    fe_sub(rr, s2, a.y);
+    if (fe_is_zero(h)) {
+        if (fe_is_zero(rr))
+            gej_double(r, a);
+        else
+            r.infinity = true;
+        return;
+    }
+    fe_mul(zh, a.z, h);
+    gej_add_finish(r, a.x, a.y, h, rr, zh);
+}
+
+void gej_add(gej &r, const gej &a, const gej &b)
+{
+    if (a.infinity) {
+        r = b;
+        return;
+    }
+    if (b.infinity) {
+        r = a;
+        return;
+    }
+    fe z12, z22, u1, u2, s1, s2, h, rr, zh;
+    fe_sqr(z12, a.z);
+    fe_sqr(z22, b.z);
+    fe_mul(u1, a.x, z22);
+    fe_mul(u2, b.x, z12);
+    fe_mul(s1, a.y, z22);
+    fe_mul(s1, s1, b.z);
+    fe_mul(s2, b.y, z12);
+    fe_mul(s2, s2, a.z);
+    fe_sub(h, u2, u1);
+    fe_sub(rr, s2, s1);
+    if (fe_is_zero(h)) {
+        if (fe_is_zero(rr))
+            gej_double(r, a);
+        else
+            r.infinity = true;
+        return;
+    }
+    fe_mul(zh, a.z, b.z);
+    fe_mul(zh, zh, h);
+    gej_add_finish(r, u1, s1, h, rr, zh);
+}
+
+//
+// Multi-scalar multiplication
+//
+const int WINDOW_A = 5;     // window for the public key, 8 table entries
+const int WINDOW_G = 12;    // window for the generator, 1024 table entries
+const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+const int WNAF_MAX = 258;
+
+const fe GX = {{0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL}};
+const fe GY = {{0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL}};
+
+// Odd multiples of G and of 2^128 * G in affine form, built on first use
+ge pretableG[TABLE_SIZE_G];
+ge pretableG128[TABLE_SIZE_G];
+boost::once_flag initTablesFlag = BOOST_ONCE_INIT;
+
+void odd_multiples_table(gej *pre, int len, const gej &a)
+{
+    gej d;
+    gej_double(d, a);
+    pre[0] = a;
+    for (int i = 1; i < len; i++)
+        gej_add(pre[i], pre[i - 1], d);
+}
+
+void InitTables()
+{
+    ge g;
+    g.x = GX;
+    g.y = GY;
+    g.infinity = false;
+    gej gj, g128;
+    gej_set_ge(gj, g);
+    g128 = gj;
+    for (int i = 0; i < 128; i++)
+        gej_double(g128, g128);
+
+    gej *pre = new gej[TABLE_SIZE_G];
+    odd_multiples_table(pre, TABLE_SIZE_G, gj);
+    ge_set_all_gej(pretableG, pre, TABLE_SIZE_G);
+    odd_multiples_table(pre, TABLE_SIZE_G, g128);
+    ge_set_all_gej(pretableG128, pre, TABLE_SIZE_G);
+    delete[] pre;
+}
+
+// Signed windowed non-adjacent form of a non-negative 256 bit number.
+// Every nonzero digit is odd and below 2^(w-1) in absolute value.
+int wnaf_encode(int *wnaf, const uint64_t a[4], int w)
+{
+    uint64_t s[5] = {a[0], a[1], a[2], a[3], 0};
+    int len = 0;
+    while (s[0] | s[1] | s[2] | s[3] | s[4]) {
+        int digit = 0;
+        if (s[0] & 1) {
+            digit = (int)(s[0] & ((1U << w) - 1));
+            if (digit >= (1 << (w - 1)))
+                digit -= (1 << w);
+            if (digit > 0) {
+                uint64_t borrow = (uint64_t)digit;
+                for (int i = 0; borrow && i < 5; i++) {
+                    uint64_t old = s[i];
+                    s[i] = old - borrow;
+                    borrow = old < borrow ? 1 : 0;
+                }
+            } else {
+                uint64_t carry = (uint64_t)(-digit);
+                for (int i = 0; carry && i < 5; i++) {
+                    s[i] += carry;
+                    carry = s[i] < carry ? 1 : 0;
+                }
+            }
+        }
+        wnaf[len++] = digit;
+        for (int i = 0; i < 4; i++)
+            s[i] = (s[i] >> 1) | (s[i + 1] << 63);
+        s[4] >>= 1;
+    }
+    return len;
+}
+
+inline void ge_table_get(ge &r, const ge *pre, int digit)
+{
+    if (digit > 0) {
+        r = pre[(digit - 1) / 2];
+    } else {
+        r = pre[(-digit - 1) / 2];
+        fe_negate(r.y, r.y);
+    }
+}
+
+inline void gej_table_get(gej &r, const gej *pre, int digit)
+{
+    if (digit > 0) {
+        r = pre[(digit - 1) / 2];
+    } else {
+        r = pre[(-digit - 1) / 2];
+        fe_negate(r.y, r.y);
+    }
+}
+
+// r = na * a + ng * G
+void ecmult(gej &r, const gej &a, const scalar &na, const scalar &ng)
+{
+    boost::call_once(InitTables, initTablesFlag);
+
+    int wnafA1[WNAF_MAX], wnafA2[WNAF_MAX], wnafG1[WNAF_MAX], wnafG2[WNAF_MAX];
+    int lenA1 = 0, lenA2 = 0;
+
+    // na * a = na1 * a + na2 * (lambda * a)
+    gej preA[TABLE_SIZE_A], preAlam[TABLE_SIZE_A];
+    if (!a.infinity && !scalar_is_zero(na)) {
+        scalar na1, na2;
+        scalar_split_lambda(na1, na2, na);
+        bool fNeg1 = scalar_is_high(na1);
+        bool fNeg2 = scalar_is_high(na2);
+        if (fNeg1)
+            scalar_negate(na1, na1);
+        if (fNeg2)
+            scalar_negate(na2, na2);
+        lenA1 = wnaf_encode(wnafA1, na1.n, WINDOW_A);
+        lenA2 = wnaf_encode(wnafA2, na2.n, WINDOW_A);
+
+        odd_multiples_table(preA, TABLE_SIZE_A, a);
+        for (int i = 0; i < TABLE_SIZE_A; i++) {
+            preAlam[i] = preA[i];
+            fe_mul(preAlam[i].x, preAlam[i].x, BETA);
+            if (fNeg2)
+                fe_negate(preAlam[i].y, preAlam[i].y);
+            if (fNeg1)
+                fe_negate(preA[i].y, preA[i].y);
+        }
+    }
+
+    // ng * G = ng_lo * G + ng_hi * (2^128 * G)
+    uint64_t ngLow[4] = {ng.n[0], ng.n[1], 0, 0};
+    uint64_t ngHigh[4] = {ng.n[2], ng.n[3], 0, 0};
+    int lenG1 = wnaf_encode(wnafG1, ngLow, WINDOW_G);
+    int lenG2 = wnaf_encode(wnafG2, ngHigh, WINDOW_G);
+
+    int nBits = lenA1;
+    if (lenA2 > nBits) nBits = lenA2;
+    if (lenG1 > nBits) nBits = lenG1;
+    if (lenG2 > nBits) nBits = lenG2;
+
+    r.infinity = true;
+    gej tj;
+    ge t;
+    for (int i = nBits - 1; i >= 0; i--) {
+        gej_double(r, r);
+        if (i < lenA1 && wnafA1[i]) {
+            gej_table_get(tj, preA, wnafA1[i]);
+            gej_add(r, r, tj);
+        }
+        if (i < lenA2 && wnafA2[i]) {
+            gej_table_get(tj, preAlam, wnafA2[i]);
+            gej_add(r, r, tj);
+        }
+        if (i < lenG1 && wnafG1[i]) {
+            ge_table_get(t, pretableG, wnafG1[i]);
+            gej_add_ge(r, r, t);
+        }
+        if (i < lenG2 && wnafG2[i]) {
+            ge_table_get(t, pretableG128, wnafG2[i]);
+            gej_add_ge(r, r, t);
+        }
+    }
+}
+
+//
+// Encodings
+//
+int ParsePubKey(ge &r, const unsigned char *pub, size_t publen)
+{
+    if (publen == 33 && (pub[0] == 0x02 || pub[0] == 0x03)) {
+        fe x;
+        if (!fe_set_b32(x, pub + 1) || !ge_set_xo(r, x, pub[0] == 0x03))
+            return UNSUPPORTED;
+        return VALID;
+    }
+    if (publen == 65 && pub[0] == 0x04) {
+        if (!fe_set_b32(r.x, pub + 1) || !fe_set_b32(r.y, pub + 33))
+            return UNSUPPORTED;
+        r.infinity = false;
+        if (!ge_is_valid(r))
+            return UNSUPPORTED;
+        return VALID;
+    }
+    // Hybrid encodings and garbage are left to OpenSSL
+    return UNSUPPORTED;
+}
+
+bool ParseDERInteger(const unsigned char *p, size_t len, unsigned char out[32])
+{
+    if (p[0] & 0x80)
+        return false; // negative
+    if (len > 1 && p[0] == 0x00 && !(p[1] & 0x80))
+        return false; // not minimally encoded
+    if (p[0] == 0x00) {
+        p++;
+        len--;
+    }
+    if (len > 32)
+        return false;
+    memset(out, 0, 32);
+    memcpy(out + 32 - len, p, len);
+    return true;
+}
+
+// Only accepts strict DER: 0x30 [total-len] 0x02 [R-len] [R] 0x02 [S-len] [S]
+bool ParseDERSignature(const unsigned char *sig, size_t siglen, unsigned char r[32], unsigned char s[32])
+{
+    if (siglen < 8 || siglen > 72)
+        return false;
+    if (sig[0] != 0x30 || sig[1] != siglen - 2)
+        return false;
+    size_t lenR = sig[3];
+    if (sig[2] != 0x02 || lenR == 0 || 5 + lenR >= siglen)
+        return false;
+    size_t lenS = sig[5 + lenR];
+    if (sig[4 + lenR] != 0x02 || lenS == 0 || lenR + lenS + 6 != siglen)
+        return false;
+    return ParseDERInteger(&sig[4], lenR, r) && ParseDERInteger(&sig[6 + lenR], lenS, s);
+}
+
+} // anon namespace
+
+bool IsEnabled()
+{
+    return true;
+}
+
+int Verify(const unsigned char *hash32, const unsigned char *sig, size_t siglen, const unsigned char *pub, size_t publen)
+{
+    ge q;
+    int ret = ParsePubKey(q, pub, publen);
+    if (ret != VALID)
+        return ret;
+    unsigned char r32[32], s32[32];
+    if (!ParseDERSignature(sig, siglen, r32, s32))
+        return UNSUPPORTED;
+
+    scalar r, s, e;
+    if (scalar_set_b32(r, r32) || scalar_is_zero(r))
+        return INVALID;
+    if (scalar_set_b32(s, s32) || scalar_is_zero(s))
+        return INVALID;
+    scalar_set_b32(e, hash32);
+
+    scalar w, u1, u2;
+    scalar_inv(w, s);
+    scalar_mul(u1, e, w);
+    scalar_mul(u2, r, w);
+
+    gej qj, pr;
+    gej_set_ge(qj, q);
+    ecmult(pr, qj, u2, u1);
+    if (pr.infinity)
+        return INVALID;
+
+    // x(pr) mod n == r, compared in Jacobian form: X == r * Z^2 or (r + n) * Z^2
+    fe xr, z2, t;
+    fe_set_b32(xr, r32);
+    fe_sqr(z2, pr.z);
+    fe_mul(t, xr, z2);
+    if (fe_equal(t, pr.x))
+        return VALID;
+    if (lt_256(r.n, PMINUSN)) {
+        static const fe FN = {{N[0], N[1], N[2], N[3]}};
+        fe_add(xr, xr, FN);
+        fe_mul(t, xr, z2);
+        if (fe_equal(t, pr.x))
+            return VALID;
+    }
+    return INVALID;
+}
+
+int Recover(const unsigned char *hash32, const unsigned char *sig64, int recid, bool fCompressed, unsigned char *pub, size_t &publen)
+{
+    if (recid < 0 || recid > 3)
+        return INVALID;
+
+    // x = r + (recid / 2) * n must be a field element
+    fe x;
+    if (!fe_set_b32(x, sig64))
+        return INVALID;
+    scalar r, s, e;
+    bool fOverflow = scalar_set_b32(r, sig64);
+    if (recid & 2) {
+        static const fe FN = {{N[0], N[1], N[2], N[3]}};
+        if (fOverflow || !lt_256(r.n, PMINUSN))
+            return INVALID;
+        fe_add(x, x, FN);
+    }
+    if (scalar_is_zero(r))
+        return UNSUPPORTED;
+    ge R;
+    if (!ge_set_xo(R, x, recid & 1))
+        return INVALID;
+    scalar_set_b32(s, sig64 + 32);
+    scalar_set_b32(e, hash32);
+
+    // Q = r^-1 * (s * R - e * G)
+    scalar rinv, u1, u2;
+    scalar_inv(rinv, r);
+    scalar_mul(u1, e, rinv);
+    scalar_negate(u1, u1);
+    scalar_mul(u2, s, rinv);
+
+    gej Rj, Qj;
+    gej_set_ge(Rj, R);
+    ecmult(Qj, Rj, u2, u1);
+    if (Qj.infinity)
+        return UNSUPPORTED;
+    ge Q;
+    ge_set_gej(Q, Qj);
+
+    if (fCompressed) {
+        pub[0] = fe_is_odd(Q.y) ? 0x03 : 0x02;
+        fe_get_b32(pub + 1, Q.x);
+        publen = 33;
+    } else {
+        pub[0] = 0x04;
+        fe_get_b32(pub + 1, Q.x);
+        fe_get_b32(pub + 33, Q.y);
+        publen = 65;
+    }
+    return VALID;
+}
+
+#else // no 128 bit integers: always defer to OpenSSL
+
+bool IsEnabled()
+{
+    return false;
+}
+
+int Verify(const unsigned char *hash32, const unsigned char *sig, size_t siglen, const unsigned char *pub, size_t publen)
+{
+    return UNSUPPORTED;
+}
+
+int Recover(const unsigned char *hash32, const unsigned char *sig64, int recid, bool fCompressed, unsigned char *pub, size_t &publen)
+{
+    return UNSUPPORTED;
+}
+
+#endif
+
+}
@@ -0,0 +1,41 @@
+// Copyright (c) 2014 The GloveCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+
+/** Native ECDSA verification and public key recovery over secp256k1.
+ *
+ * Only public data is ever processed here, so the arithmetic is variable
+ * time and tuned for throughput: 4x64 bit field limbs, wNAF multiplication
+ * with the GLV endomorphism for the public key and precomputed tables for
+ * the generator. Signing stays with OpenSSL.
+ *
+ * Anything that is not a plain, strictly encoded input is reported as
+ * UNSUPPORTED so that the caller can hand it to OpenSSL unchanged; this
+ * keeps the accepted signature set identical to the OpenSSL one.
+ */
+namespace secp256k1 {
+
+enum
+{
+    UNSUPPORTED = -1,
+    INVALID = 0,
+    VALID = 1
+};
+
+/** Whether the native engine is compiled in (it needs 128 bit integers) */
+bool IsEnabled();
+
+/** Verify a DER encoded signature of a 32 byte hash against a serialized public key */
+int Verify(const unsigned char *hash32, const unsigned char *sig, size_t siglen, const unsigned char *pub, size_t publen);
+
+/** Recover the public key from a 64 byte compact signature (r || s).
+ *  pub must have room for 65 bytes; publen receives 33 or 65. */
+int Recover(const unsigned char *hash32, const unsigned char *sig64, int recid, bool fCompressed, unsigned char *pub, size_t &publen);
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include <boost/test/unit_test.hpp>
+
+#include "arith_uint256.h"
+#include "bignum.h"
+#include "chainparams.h"
+#include "kernel.h"
+#include "main.h"
+
+BOOST_AUTO_TEST_SUITE(arith_uint256_tests)
+
+// Differential tests: the difficulty, trust and kernel code moved from
+// CBigNum to arith_uint256 and must keep producing bit-identical results,
+// so the production functions are checked against the CBigNum math.
+
+static uint32_t nRandZ = 11, nRandW = 11;
+
+static uint32_t insecure_rand()
+{
+    nRandZ = 36969 * (nRandZ & 65535) + (nRandZ >> 16);
+    nRandW = 18000 * (nRandW & 65535) + (nRandW >> 16);
+    return (nRandW << 16) + nRandZ;
+}
+
+// Random value with a random number of significant bits
+static arith_uint256 RandomValue(unsigned int nMaxBits = 256)
+{
+    std::vector<unsigned char> vch(32);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = insecure_rand() & 0xff;
+    arith_uint256 n(vch);
+    return n >> (insecure_rand() % nMaxBits);
+}
+
+static unsigned int RandomCompact()
+{
+    // Mostly sizes around the valid target range, some of them far out
+    unsigned int nSize = insecure_rand() % 4 ? insecure_rand() % 36 : insecure_rand() % 256;
+    return (nSize << 24) | (insecure_rand() & 0x00ffffff);
+}
+
+BOOST_AUTO_TEST_CASE(arith_compact)
+{
+    BOOST_CHECK_EQUAL(arith_uint256().SetCompact(0x1d00ffff).GetCompact(), 0x1d00ffffU);
+    BOOST_CHECK_EQUAL(arith_uint256(0x80).GetCompact(), 0x02008000U);
+    BOOST_CHECK_EQUAL(arith_uint256(0).GetCompact(), 0U);
+
+    bool fNegative, fOverflow;
+    arith_uint256().SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+    arith_uint256().SetCompact(0xff123456, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && fOverflow);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        unsigned int nCompact = RandomCompact();
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        arith_uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, (fNegative ? -bn : bn) > CBigNum(~uint256(0)));
+        if (!fOverflow)
+            BOOST_CHECK(n == (fNegative ? -bn : bn).getuint256());
+        if (!fNegative && !fOverflow)
+            BOOST_CHECK_EQUAL(n.GetCompact(), bn.GetCompact());
+
+        arith_uint256 r = RandomValue();
+        BOOST_CHECK_EQUAL(r.GetCompact(), CBigNum(r).GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_mul_div)
+{
+    for (int i = 0; i < 5000; i++)
+    {
+        arith_uint256 a = RandomValue();
+        arith_uint256 b = RandomValue();
+        // products are kept modulo 2^256, like CBigNum::getuint256 truncates
+        BOOST_CHECK(a * b == (CBigNum(a) * CBigNum(b)).getuint256());
+        if (b != 0)
+            BOOST_CHECK(a / b == (CBigNum(a) / CBigNum(b)).getuint256());
+        CBigNum bnA(a);
+        BOOST_CHECK_EQUAL(a.bits(), (unsigned int)BN_num_bits(&bnA));
+    }
+    BOOST_CHECK_THROW(arith_uint256(1) / arith_uint256(0), uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(arith_block_trust)
+{
+    for (int i = 0; i < 5000; i++)
+    {
+        unsigned int nBits = RandomCompact();
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        uint256 nTrustBig = bnTarget <= 0 ? uint256(0) : ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+
+        CBlockIndex index;
+        index.nBits = nBits;
+        BOOST_CHECK(index.GetBlockTrust() == nTrustBig);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_stake_target)
+{
+    for (int i = 0; i < 5000; i++)
+    {
+        unsigned int nBits = RandomCompact();
+        int64_t nValue = ((uint64_t)insecure_rand() << 32 | insecure_rand()) >> (1 + insecure_rand() % 63);
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        bnTarget *= CBigNum(nValue);
+
+        bool fAnyHash, fNoHash;
+        arith_uint256 nTarget = GetStakeTarget(nBits, nValue, fAnyHash, fNoHash);
+        BOOST_CHECK(nTarget == bnTarget.getuint256());
+
+        for (int j = 0; j < 4; j++)
+        {
+            uint256 hash = RandomValue();
+            bool fBig = !(CBigNum(hash) > bnTarget);
+            bool fArith = !fNoHash && (fAnyHash || hash <= nTarget);
+            BOOST_CHECK_EQUAL(fBig, fArith);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_retarget)
+{
+    const CChainParams::Network networks[] = { CChainParams::MAIN, CChainParams::REGTEST };
+    for (int i = 0; i < 5000; i++)
+    {
+        SelectParams(networks[i % 2]);
+        CBigNum bnLimit(Params().ProofOfWorkLimit());
+
+        // genesis <- prevprev <- prev, all proof-of-work
+        CBlockIndex chain[3];
+        for (int n = 0; n < 3; n++)
+        {
+            chain[n].nHeight = 1000 + n;
+            chain[n].pprev = n ? &chain[n - 1] : NULL;
+        }
+        chain[1].nTime = 1400000000;
+        chain[2].nTime = chain[1].nTime + (int)(insecure_rand() % 5000) - 1000;
+        arith_uint256 nPrev = RandomValue() & Params().ProofOfWorkLimit();
+        chain[2].nBits = (nPrev == 0 ? arith_uint256(1) : nPrev).GetCompact();
+
+        // The CBigNum retarget the arith_uint256 version replaced
+        int64_t nTargetSpacing = GetTargetSpacing(chain[2].nHeight);
+        int64_t nActualSpacing = std::min(chain[2].GetBlockTime() - chain[1].GetBlockTime(), nTargetSpacing * 10);
+        int64_t nInterval = 16 * 60 / nTargetSpacing;
+        CBigNum bnNew;
+        bnNew.SetCompact(chain[2].nBits);
+        bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
+        bnNew /= ((nInterval + 1) * nTargetSpacing);
+        if (bnNew <= 0 || bnNew > bnLimit)
+            bnNew = bnLimit;
+
+        BOOST_CHECK_EQUAL(GetNextTargetRequired(&chain[2], false), bnNew.GetCompact());
+    }
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
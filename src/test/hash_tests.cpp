@@ -0,0 +1,22 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+
+BOOST_AUTO_TEST_SUITE(hash_tests)
+
+BOOST_AUTO_TEST_CASE(siphash_uint256)
+{
+    // Reference SipHash-2-4: key 00..0f, message 00..1f
+    uint256 val;
+    unsigned char* p = (unsigned char*)&val;
+    for (int i = 0; i < 32; i++)
+        p[i] = i;
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+
+    // Per table salt, but stable for the lifetime of one hasher
+    CUint256Hasher hasher;
+    BOOST_CHECK_EQUAL(hasher(val), hasher(val));
+    BOOST_CHECK(hasher(val) != hasher(uint256(0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
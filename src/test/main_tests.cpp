@@ -0,0 +1,51 @@
+#include <boost/test/unit_test.hpp>
+
+#include "chainparams.h"
+#include "main.h"
+
+#include <stdio.h>
+
+BOOST_AUTO_TEST_SUITE(main_tests)
+
+static void WriteBlock(FILE* file, unsigned int nJunk, const std::vector<char>& vchBlock)
+{
+    unsigned int nSize = vchBlock.size();
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    for (unsigned int i = 0; i < nJunk; i++)
+        fputc(pchMessageStart[0] ^ 0xff, file);
+    fwrite(pchMessageStart, 1, MESSAGE_START_SIZE, file);
+    fwrite(&nSize, 1, sizeof(nSize), file);
+    fwrite(&vchBlock[0], 1, vchBlock.size(), file);
+}
+
+// Blocks are found whether or not their marker, size and payload share a
+// window of the read buffer
+BOOST_AUTO_TEST_CASE(external_block_reader_boundary)
+{
+    std::vector<char> vchFirst(5, 'a');
+    std::vector<char> vchSecond(40, 'b');
+
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file);
+    // The first marker fills the last bytes of a 16 byte window, so its size
+    // is only read after a refill
+    WriteBlock(file, 12, vchFirst);
+    // Larger than the window
+    WriteBlock(file, 3, vchSecond);
+    // Marker with a cut off size at the end of the file
+    fwrite("\x00\x00", 1, 2, file);
+    fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, file);
+    fwrite("\x01\x00", 1, 2, file);
+    rewind(file);
+
+    CExternalBlockReader reader(file, 16);
+    std::vector<char> vchBlock;
+    BOOST_CHECK(reader.Next(vchBlock));
+    BOOST_CHECK(vchBlock == vchFirst);
+    BOOST_CHECK(reader.Next(vchBlock));
+    BOOST_CHECK(vchBlock == vchSecond);
+    BOOST_CHECK(!reader.Next(vchBlock));
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
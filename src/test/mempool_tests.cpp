@@ -0,0 +1,51 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_shared_tx)
+{
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(uint256(1), 0);
+    txParent.vin[0].scriptSig << OP_1;
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = 10 * COIN;
+    txParent.vout[1].nValue = 5 * COIN;
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 4 * COIN;
+
+    // Hash and size are fixed when the shared copy is made
+    CTransactionRef ptxParent = MakeTransactionRef(txParent);
+    BOOST_CHECK(ptxParent->GetHash() == txParent.GetHash());
+    BOOST_CHECK_EQUAL(ptxParent->GetTxSize(), ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION));
+
+    CTxMemPool pool;
+    pool.addUnchecked(ptxParent->GetHash(), ptxParent);
+    CTransactionRef ptxChild = MakeTransactionRef(txChild);
+    pool.addUnchecked(ptxChild->GetHash(), ptxChild);
+
+    // The pool hands out the instance it was given instead of a copy
+    BOOST_CHECK(pool.get(txParent.GetHash()) == ptxParent);
+    BOOST_CHECK(pool.mapNextTx[txChild.vin[0].prevout].ptx == ptxChild.get());
+    BOOST_CHECK(!pool.get(uint256(1)));
+
+    CTransaction txLookup;
+    BOOST_CHECK(pool.lookup(txChild.GetHash(), txLookup));
+    BOOST_CHECK(txLookup == txChild);
+
+    // Removing the parent takes its spender along, while outside references
+    // stay valid
+    pool.remove(txParent, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.mapNextTx.empty());
+    BOOST_CHECK(ptxChild->GetHash() == txChild.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,50 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "key.h"
+#include "secp256k1.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_verify)
+{
+    if (!secp256k1::IsEnabled())
+        return;
+
+    for (int n = 0; n < 64; n++)
+    {
+        CKey key;
+        key.MakeNewKey(n % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(secp256k1::Verify(hash.begin(), &vchSig[0], vchSig.size(), pubkey.begin(), pubkey.size()) == secp256k1::VALID);
+
+        uint256 hashOther = hash ^ 1;
+        BOOST_CHECK(secp256k1::Verify(hashOther.begin(), &vchSig[0], vchSig.size(), pubkey.begin(), pubkey.size()) == secp256k1::INVALID);
+
+        // Lax DER is never judged natively, OpenSSL keeps the final word
+        vector<unsigned char> vchLax(vchSig);
+        vchLax[1]++;
+        vchLax.push_back(0);
+        BOOST_CHECK(secp256k1::Verify(hash.begin(), &vchLax[0], vchLax.size(), pubkey.begin(), pubkey.size()) == secp256k1::UNSUPPORTED);
+
+        // Compact signatures recover to the signing key
+        vector<unsigned char> vchCompact;
+        BOOST_CHECK(key.SignCompact(hash, vchCompact));
+        unsigned char pub[65];
+        size_t publen = 0;
+        BOOST_CHECK(secp256k1::Recover(hash.begin(), &vchCompact[1], (vchCompact[0] - 27) & ~4, (vchCompact[0] - 27) & 4, pub, publen) == secp256k1::VALID);
+        BOOST_CHECK(CPubKey(pub, pub + publen) == pubkey);
+        BOOST_CHECK(pubkey.VerifyCompact(hash, vchCompact));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
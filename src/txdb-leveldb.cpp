@@ -14,6 +14,7 @@
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#include "checkqueue.h"
 #include "kernel.h"
 #include "txdb.h"
 #include "util.h"
@@ -25,6 +26,10 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// True while the "snapshotid" record in the database names the snapshot file
+// on disk. The first change to the block index after that erases the record.
+static bool fSnapshotIdStored = false;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
@@ -74,6 +79,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    batchOverlay = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -104,6 +110,8 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            delete batchOverlay;
+            batchOverlay = NULL;
 
             init_blockindex(options, true, true); // Remove directory and create new database
             pdb = txdb;
@@ -135,12 +143,15 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    delete batchOverlay;
+    batchOverlay = NULL;
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    batchOverlay = new BatchOverlay();
     return true;
 }
 
@@ -148,57 +159,40 @@ bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    bool fErasedSnapshotId = false;
+    if (fSnapshotIdStored) {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string("snapshotid");
+        fErasedSnapshotId = batchOverlay->count(ssKey.str()) > 0;
+    }
     delete activeBatch;
     activeBatch = NULL;
+    delete batchOverlay;
+    batchOverlay = NULL;
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
+    if (fErasedSnapshotId)
+        fSnapshotIdStored = false;
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The overlay
+// mirrors the batch, so this is a single hash lookup instead of a scan.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
+    assert(activeBatch && batchOverlay);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    BatchOverlay::const_iterator it = batchOverlay->find(key.str());
+    if (it == batchOverlay->end())
+        return false;
+    if (it->second.fDeleted)
+        *deleted = true;
+    else
+        *value = it->second.strValue;
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -259,6 +253,7 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    InvalidateBlockIndexSnapshot();
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
@@ -269,6 +264,7 @@ bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    InvalidateBlockIndexSnapshot();
     return Write(string("hashBestChain"), hashBestChain);
 }
 
@@ -288,106 +284,378 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (blockIndexArena.Allocate()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+//
+// Block index snapshot
+//
+// Loading the block index from LevelDB means walking every "blockindex"
+// record, resolving prev/next by hash and sorting the whole index by height
+// to compute chain trust. On a clean shutdown the index is also dumped to a
+// flat file with links stored as record numbers and chain trust included,
+// which the next start reads back in one sequential pass. The file is only
+// used while the database still carries its random id: the first change to
+// the block index erases the id, and startup falls back to the full scan.
+//
+
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+/** Serializes the fields of one block index entry for the snapshot file */
+class CBlockIndexSnapshotEntry
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+public:
+    CBlockIndex* pindex;
+    int nPrev;
+    int nNext;
+
+    CBlockIndexSnapshotEntry(CBlockIndex* pindexIn, int nPrevIn = -1, int nNextIn = -1)
+        : pindex(pindexIn), nPrev(nPrevIn), nNext(nNextIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nPrev);
+        READWRITE(nNext);
+        READWRITE(pindex->nHeight);
+        READWRITE(pindex->nFlags);
+        READWRITE(pindex->nTime);
+        READWRITE(pindex->nBits);
+        READWRITE(pindex->nNonce);
+        READWRITE(pindex->nVersion);
+        READWRITE(pindex->hashProof);
+        READWRITE(pindex->nStakeModifier);
+        READWRITE(pindex->nChainTrust);
+        READWRITE(pindex->nMint);
+        READWRITE(pindex->nMoneySupply);
+        READWRITE(pindex->nStakeWeightSpent);
+        READWRITE(pindex->nFile);
+        READWRITE(pindex->nBlockPos);
+        READWRITE(pindex->prevoutStake);
+        READWRITE(pindex->nStakeTime);
+        READWRITE(pindex->hashMerkleRoot);
+    )
+};
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+void CTxDB::InvalidateBlockIndexSnapshot()
+{
+    if (!fSnapshotIdStored)
+        return;
+    // Inside a batch the erase only sticks once TxnCommit succeeds
+    if (Erase(string("snapshotid")) && !activeBatch)
+        fSnapshotIdStored = false;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+    assert(!activeBatch);
+
+    uint256 hashBestChainDB;
+    if (pindexBest == NULL || !ReadHashBestChain(hashBestChainDB) || hashBestChainDB != pindexBest->GetBlockHash())
+        return false;
+
+    // Number the entries so that links can be stored as record numbers
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    boost::unordered_map<const CBlockIndex*, int> mapRecord;
+    mapRecord.rehash(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        mapRecord[item.second] = vIndex.size();
+        vIndex.push_back(item.second);
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+
+    uint64_t nSnapshotId = GetRand(std::numeric_limits<uint64_t>::max());
+
+    // serialize header and entries, checksum data up to that point, then append csum
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot << FLATDATA(Params().MessageStart());
+    ssSnapshot << BLOCKINDEX_SNAPSHOT_VERSION << nSnapshotId << hashBestChainDB;
+    ssSnapshot << (unsigned int)vIndex.size();
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        CBlockIndexSnapshotEntry entry(pindex);
+        if (pindex->pprev)
+            entry.nPrev = mapRecord[pindex->pprev];
+        if (pindex->pnext)
+            entry.nNext = mapRecord[pindex->pnext];
+        ssSnapshot << pindex->GetBlockHash() << entry;
+    }
+    uint256 hash = Hash(ssSnapshot.begin(), ssSnapshot.end());
+    ssSnapshot << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("blkindex.snapshot.%04x", GetRand(0x10000));
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout << ssSnapshot;
+    }
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetBlockIndexSnapshotPath()))
+        return error("WriteBlockIndexSnapshot() : Rename-into-place failed");
+
+    // Only now does the database vouch for the file
+    if (!Write(string("snapshotid"), nSnapshotId))
+        return error("WriteBlockIndexSnapshot() : failed to write snapshot id");
+    fSnapshotIdStored = true;
+
+    LogPrintf("WriteBlockIndexSnapshot() : wrote %u entries\n", vIndex.size());
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    uint64_t nSnapshotIdDB;
+    uint256 hashBestChainDB;
+    if (!boost::filesystem::exists(pathSnapshot) || !Read(string("snapshotid"), nSnapshotIdDB) ||
+        !ReadHashBestChain(hashBestChainDB))
+        return false;
+
+    FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadBlockIndexSnapshot() : open failed");
+
+    // read the whole file straight into the stream, then verify the checksum
+    int64_t nDataSize = (int64_t)boost::filesystem::file_size(pathSnapshot) - (int64_t)sizeof(uint256);
+    if (nDataSize <= 0)
+        return error("LoadBlockIndexSnapshot() : file too short");
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot.resize(nDataSize);
+    uint256 hashIn;
+    try {
+        filein.read(&ssSnapshot[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadBlockIndexSnapshot() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    if (Hash(ssSnapshot.begin(), ssSnapshot.end()) != hashIn)
+        return error("LoadBlockIndexSnapshot() : checksum mismatch; data corrupted");
+
+    try {
+        unsigned char pchMsgTmp[4];
+        int nSnapshotVersion;
+        uint64_t nSnapshotId;
+        uint256 hashBestChainSnapshot;
+        unsigned int nCount;
+        ssSnapshot >> FLATDATA(pchMsgTmp) >> nSnapshotVersion >> nSnapshotId >> hashBestChainSnapshot >> nCount;
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) ||
+            nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+            return error("LoadBlockIndexSnapshot() : incompatible snapshot");
+        if (nSnapshotId != nSnapshotIdDB || hashBestChainSnapshot != hashBestChainDB)
+        {
+            LogPrintf("LoadBlockIndexSnapshot() : snapshot is stale\n");
+            return false;
         }
 
-        // GloveCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        mapBlockIndex.rehash(nCount);
+        vector<CBlockIndex*> vIndex(nCount);
+        vector<pair<int, int> > vLinks(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            uint256 hashBlock;
+            ssSnapshot >> hashBlock;
+            CBlockIndexSnapshotEntry entry(InsertBlockIndex(hashBlock));
+            ssSnapshot >> entry;
+            vIndex[i] = entry.pindex;
+            vLinks[i] = make_pair(entry.nPrev, entry.nNext);
+        }
 
-        iterator->Next();
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            CBlockIndex* pindexNew = vIndex[i];
+            int nPrev = vLinks[i].first, nNext = vLinks[i].second;
+            if (nPrev < -1 || nPrev >= (int)nCount || nNext < -1 || nNext >= (int)nCount)
+                throw runtime_error("link out of range");
+            pindexNew->pprev = nPrev < 0 ? NULL : vIndex[nPrev];
+            pindexNew->pnext = nNext < 0 ? NULL : vIndex[nNext];
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && pindexNew->GetBlockHash() == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex())
+                throw runtime_error(strprintf("CheckIndex failed at %d", pindexNew->nHeight));
+
+            // GloveCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+    }
+    catch (std::exception &e) {
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        pindexGenesisBlock = NULL;
+        return error("LoadBlockIndexSnapshot() : %s", e.what());
     }
-    delete iterator;
 
-    boost::this_thread::interruption_point();
+    LogPrintf("LoadBlockIndexSnapshot() : loaded %u entries\n", mapBlockIndex.size());
+    return true;
+}
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+/** Consecutive best chain blocks read and checked together at startup */
+struct CVerifyBlocksBatch
+{
+    std::vector<CBlockIndex*> vpindex;
+    std::vector<CBlock> vblock;
+    std::vector<char> vfValid; // CheckBlock result per block
+    bool fRead;
+
+    CVerifyBlocksBatch() : fRead(false) {}
+};
+
+/** Startup verification of one batch: reads the blocks from disk and runs
+ *  the context-free checks of level 1. The results are left in the batch
+ *  and reported in chain order by LoadBlockIndex, so this always succeeds. */
+class CVerifyBlocksCheck
+{
+private:
+    CVerifyBlocksBatch* pbatch;
+    int nCheckLevel;
+
+public:
+    CVerifyBlocksCheck() : pbatch(NULL), nCheckLevel(0) {}
+    CVerifyBlocksCheck(CVerifyBlocksBatch* pbatchIn, int nCheckLevelIn) :
+        pbatch(pbatchIn), nCheckLevel(nCheckLevelIn) {}
+
+    bool operator()()
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        pbatch->fRead = ReadBlocksFromDisk(pbatch->vpindex, pbatch->vblock);
+        if (pbatch->fRead && nCheckLevel > 0)
+        {
+            pbatch->vfValid.resize(pbatch->vblock.size());
+            for (unsigned int i = 0; i < pbatch->vblock.size(); i++)
+                pbatch->vfValid[i] = pbatch->vblock[i].CheckBlock(true, true, nCheckLevel > 6);
+        }
+        return true;
+    }
+
+    void swap(CVerifyBlocksCheck& check)
+    {
+        std::swap(pbatch, check.pbatch);
+        std::swap(nCheckLevel, check.nCheckLevel);
+    }
+};
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    // A leftover snapshot id must still be erased by the first index write,
+    // whether or not the snapshot it names turns out to be usable.
+    fSnapshotIdStored = Exists(string("snapshotid"));
+    if (!LoadBlockIndexSnapshot())
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        // The block index is an in-memory structure that maps hashes to on-disk
+        // locations where the contents of the block can be found. Here, we scan it
+        // out of the DB and into mapBlockIndex.
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        // Seek to start key.
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), uint256(0));
+        iterator->Seek(ssStartKey.str());
+        // Now read each entry.
+        while (iterator->Valid())
+        {
+            boost::this_thread::interruption_point();
+            // Unpack keys and values.
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            string strType;
+            ssKey >> strType;
+            // Did we reach the end of the data to read?
+            if (strType != "blockindex")
+                break;
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            uint256 blockHash = diskindex.GetBlockHash();
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete iterator;
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
+
+            // GloveCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+            iterator->Next();
+        }
+        delete iterator;
+
+        boost::this_thread::interruption_point();
+
+        // Calculate nChainTrust
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        }
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -400,6 +668,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -422,21 +691,58 @@ bool CTxDB::LoadBlockIndex()
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    // Reading the blocks and the level 1 checks run on -par threads, a
+    // window of batches at a time. The checks of the higher levels look at
+    // the blocks above the current one and stay on this thread.
+    CCheckQueue<CVerifyBlocksCheck> verifyqueue(1);
+    CCheckQueueThreads<CVerifyBlocksCheck> verifyThreads(verifyqueue, nScriptCheckThreads - 1);
+    const unsigned int nWindowBatches = 4 * std::max(nScriptCheckThreads, 1);
+    vector<CVerifyBlocksBatch> vBatches;
+    vBatches.reserve(nWindowBatches);
+    unsigned int nBatch = 0;
+    unsigned int nBatchPos = 0;
+    CBlockIndex* pindexRead = pindexBest;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        if (nBatch == vBatches.size())
+        {
+            // Read ahead in batches so that the headers are hashed together
+            vBatches.clear();
+            while (vBatches.size() < nWindowBatches && pindexRead && pindexRead->pprev && pindexRead->nHeight >= nBestHeight-nCheckDepth)
+            {
+                vBatches.push_back(CVerifyBlocksBatch());
+                CVerifyBlocksBatch& batch = vBatches.back();
+                for (; pindexRead && pindexRead->pprev && pindexRead->nHeight >= nBestHeight-nCheckDepth && batch.vpindex.size() < 16; pindexRead = pindexRead->pprev)
+                    batch.vpindex.push_back(pindexRead);
+            }
+            vector<CVerifyBlocksCheck> vChecks;
+            for (unsigned int i = 0; i < vBatches.size(); i++)
+                vChecks.push_back(CVerifyBlocksCheck(&vBatches[i], nCheckLevel));
+            CCheckQueueControl<CVerifyBlocksCheck> control(&verifyqueue);
+            control.Add(vChecks);
+            control.Wait();
+            nBatch = 0;
+            nBatchPos = 0;
+        }
+        const CVerifyBlocksBatch& batch = vBatches[nBatch];
+        if (!batch.fRead)
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
+        const CBlock& block = batch.vblock[nBatchPos];
         // check level 1: verify block validity
         // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+        if (nCheckLevel>0 && !batch.vfValid[nBatchPos])
         {
             LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             pindexFork = pindex->pprev;
         }
+        if (++nBatchPos == batch.vpindex.size())
+        {
+            nBatch++;
+            nBatchPos = 0;
+        }
         // check level 2: verify transaction index validity
         if (nCheckLevel>1)
         {
@@ -12,6 +12,8 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
@@ -35,6 +37,7 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        delete batchOverlay;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -46,6 +49,17 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // Latest pending state of every key written or erased in activeBatch,
+    // so that reads inside a transaction do not have to walk the batch.
+    struct CBatchEntry
+    {
+        bool fDeleted;
+        std::string strValue;
+    };
+    typedef boost::unordered_map<std::string, CBatchEntry> BatchOverlay;
+    BatchOverlay *batchOverlay;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -53,7 +67,7 @@ private:
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // delete for it. Looks the key up in batchOverlay, so it is O(1).
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
     template<typename K, typename T>
@@ -111,7 +125,11 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            CBatchEntry &entry = (*batchOverlay)[strKey];
+            entry.fDeleted = false;
+            entry.strValue = ssValue.str();
+            activeBatch->Put(strKey, entry.strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +152,11 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            CBatchEntry &entry = (*batchOverlay)[strKey];
+            entry.fDeleted = true;
+            entry.strValue.clear();
+            activeBatch->Delete(strKey);
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,9 +173,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+            if (ScanBatch(ssKey, &unused, &deleted))
+                return !deleted;
         }
 
 
@@ -169,6 +190,8 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        delete batchOverlay;
+        batchOverlay = NULL;
         return true;
     }
 
@@ -198,8 +221,11 @@ public:
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    void InvalidateBlockIndexSnapshot();
 };
 
 
@@ -6,8 +6,11 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "hash.h"
 #include "sync.h"
 
+#include <boost/unordered_map.hpp>
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -25,12 +28,13 @@ private:
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    typedef boost::unordered_map<uint256, CTransactionRef, CUint256Hasher> TxMap;
+    TxMap mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTransactionRef& ptx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -51,6 +55,10 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    /** The pool's own copy of a transaction, without copying it, or a null
+     *  reference if it is not in the pool */
+    CTransactionRef get(const uint256& hash) const;
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -363,6 +363,11 @@ public:
         return pn[0] | (uint64_t)pn[1] << 32;
     }
 
+    uint64_t GetUint64(int pos) const
+    {
+        return pn[2 * pos] | (uint64_t)pn[2 * pos + 1] << 32;
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
         return sizeof(pn);
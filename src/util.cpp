@@ -39,6 +39,10 @@ namespace boost {
 #include <openssl/rand.h>
 #include <stdarg.h>
 
+#if defined(MAC_OSX) || defined(__linux__)
+#include <fcntl.h>
+#endif
+
 #ifdef WIN32
 #ifdef _MSC_VER
 #pragma warning(disable:4786)
@@ -1089,6 +1093,26 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length)
+{
+    // Advisory only: reserves the space without changing the file size, so
+    // appends still land right after the data already written
+#if defined(MAC_OSX)
+    fstore_t fst;
+    fst.fst_flags = F_ALLOCATECONTIG;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_offset = 0;
+    fst.fst_length = (off_t)offset + length;
+    fst.fst_bytesalloc = 0;
+    if (fcntl(fileno(file), F_PREALLOCATE, &fst) == -1) {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fileno(file), F_PREALLOCATE, &fst);
+    }
+#elif defined(__linux__)
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
@@ -14,6 +14,7 @@
 
 #include "crypter.h"
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -89,6 +90,10 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // stake kernel inputs of the staking coins, valid for hashStakeCacheTip only
+    StakeCacheMap mapStakeCache;
+    uint256 hashStakeCacheTip;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet